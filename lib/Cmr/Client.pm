@@ -128,6 +128,15 @@ sub _reduce_input_set {
 }
 
 
+# Aggregation types of a plain "cmr-reduce <types>" reducer, cmr-merge can apply these itself while merging
+sub _combine_spec {
+    my ($reducer) = @_;
+    return unless $reducer and $reducer =~ /^\s*cmr-reduce((?:\s+[csmM]+)+)\s*$/o;
+    (my $spec = $1) =~ s/\s+//go;
+    return $spec;
+}
+
+
 sub grep {
     my ($self, %kwargs) = @_; 
 
@@ -157,7 +166,7 @@ sub grep {
         $path =~ s/^(?!$args{'basepath'})/$args{'basepath'}\//o;
         my $glob = $self->{'globber'}->PosixGlob($path);
 
-        while ( my ($ext, $batch) = $glob->next($batchsize) ) {
+        while ( my ($ext, $batch) = $glob->next($batchsize, ($args{'split_size'} // 0) * 1024 * 1024) ) {
             map { s/^$args{'basepath'}//o; $_; } @$batch;
 
             $self->{'reactor'}->push({
@@ -315,6 +324,15 @@ sub sequential_merge {
     print STDERR "Performing Sequential Merge\n";
     sysopen(OUT, sprintf("%s/%s", $self->{'reactor'}->{'output_path'}, $args{'outfile'}), O_WRONLY|O_CREAT|O_BINARY);
     for my $file (@input) {
+        if ( $args{'compress_intermediate'} or $args{'binary_intermediate'} ) {
+            # Compressed or binary intermediates go through chunky to come out as text
+            open(IN, '-|', 'chunky', '-s', '4', $file) or next;
+            while ( sysread(IN, my $buf, 4*1024*1024) ) {
+                syswrite(OUT, $buf);
+            }
+            close(IN);
+            next;
+        }
         sysopen(IN, $file, O_RDONLY|O_BINARY );
         my $size = -s IN;
         sysread(IN, my $buf, $size);
@@ -440,6 +458,8 @@ sub stream {
     my $fixed_args = {};
     $fixed_args->{'type'}    = &Cmr::Types::CMR_STREAM;
     $fixed_args->{'mapper'}  = $args{'mapper'}  if exists $args{'mapper'};
+    $fixed_args->{'mapper_copies'}  = $args{'mapper_copies'}  if $args{'mapper_copies'};
+    $fixed_args->{'mapper_ordered'} = $args{'mapper_ordered'} if $args{'mapper_ordered'};
     $fixed_args->{'reducer'} = $reducer if defined $reducer;
 
     unless ( $self->{'reactor'}->{'output_path'} ) {
@@ -453,7 +473,7 @@ sub stream {
 
         $path =~ s/^(?!$args{'basepath'})/$args{'basepath'}\//o;
         my $glob = $self->{'globber'}->PosixGlob($path);
-        while ( my ($ext, $batch) = $glob->next($batchsize) ) {
+        while ( my ($ext, $batch) = $glob->next($batchsize, ($args{'split_size'} // 0) * 1024 * 1024) ) {
             map { s/^$args{'basepath'}//o; $_; } @$batch;
 
             my $task_args = {
@@ -496,6 +516,7 @@ sub merge_buckets {
         'in_order'          => 0,
         'delimiter'         => "",
         'outfile'           => 'output',
+        'final'             => 0,
     );
 
     # merge defaults, configuartion and passed args
@@ -522,6 +543,13 @@ sub merge_buckets {
                 push @cleanup_files, $file;
             }
 
+            # The last merge of a bucket runs alone, let it spread over several cores
+            my $threads = ( $#{$bucket} < $batchsize ) ? ($args{'merge_threads'} // 1) : 1;
+            # and when it is the job's output ( final ) it is written as uncompressed text
+            my $last = ( $args{'final'} and $#{$bucket} < $batchsize );
+            my $compress = $last ? 0 : $args{'compress_intermediate'};
+            my $binary = $last ? 0 : $args{'binary_intermediate'};
+
             while ( $start_index <= $#{$bucket} ) {
                 my $end_index = $start_index + $args{'merge_batch_size'}-1;
                 if ( $end_index > $#{$bucket} ) {
@@ -538,7 +566,12 @@ sub merge_buckets {
                     'input'         =>  \@task_files,
                     'destination'   =>  $file,
                     'in_order'      =>  $args{'in_order'},
+                    'combine'       =>  $args{'combine'},
+                    'hot_keys'      =>  $args{'hot_keys'},
+                    'threads'       =>  $threads,
                     'delimiter'     =>  $args{'delimiter'},
+                    'compress'      =>  $compress,
+                    'binary'        =>  $binary,
                 });
 
                 # Keep a mapping files -> buckets
@@ -647,6 +680,7 @@ sub reduce_buckets {
                         'reducer'       =>  $args{'final_reducer'},
                         'input'         =>  \@task_files,
                         'destination'   =>  $file,
+                        'compress'      =>  $args{'compress_intermediate'},
                     });
                 }
                 else {
@@ -655,6 +689,7 @@ sub reduce_buckets {
                         'reducer'       =>  $args{'reducer'},
                         'input'         =>  \@task_files,
                         'destination'   =>  $file,
+                        'compress'      =>  $args{'compress_intermediate'},
                     });
                 }
 
@@ -702,6 +737,130 @@ sub reduce_buckets {
     return $input;
 }
 
+# Samples the mapped keys of a few batches and writes splitters that cut them into equal bucket ranges
+# Returns the splitter file and the number of buckets (duplicate splitters are dropped, so maybe fewer than asked for)
+sub _range_splitters {
+    my ($self, $batches, %args) = @_;
+
+    my $sample_batches = $args{'range_sample_batches'} // 8;
+    my $sample_every   = $args{'range_sample_every'} // 100;
+    my $step = scalar(@$batches) / $sample_batches;
+    $step = 1 if $step < 1;
+
+    my $sample_id = 0;
+    for (my $i = 0; $i < scalar(@$batches); $i += $step) {
+        my ($ext, $batch) = @{$batches->[int($i)]};
+
+        $self->{'reactor'}->push({
+            'type'          =>  &Cmr::Types::CMR_STREAM,
+            'mapper'        =>  $args{'mapper'},
+            'mapper_copies' =>  $args{'mapper_copies'},
+            'mapper_ordered' =>  $args{'mapper_ordered'},
+            'reducer'       =>  "cmr-bucket --delimiter $args{'delimiter'} --sample ${sample_every}",
+            'input'         =>  $batch,
+            'ext'           =>  $ext,
+            'destination'   =>  sprintf("%s/range_sample-%d", $self->{'reactor'}->{'output_path'}, $sample_id++),
+        });
+        return if $self->{'reactor'}->failed();
+    }
+
+    $self->{'reactor'}->sync();
+    my @samples = $self->{'reactor'}->get_job_output();
+    $self->{'reactor'}->clear_job_output();
+    return if $self->{'reactor'}->failed();
+
+    my @keys;
+    for my $file (@samples) {
+        open(my $fh, '<', $file) or next;
+        binmode($fh);
+        while ( my $key = <$fh> ) {
+            chomp $key;
+            push @keys, $key;
+        }
+        close($fh);
+    }
+    $self->cleanup('input'=>\@samples);
+    $self->{'reactor'}->sync();
+    $self->{'reactor'}->clear_job_output();
+
+    # Plain string order is byte order, the order cmr-bucket and cmr-merge compare keys in
+    @keys = sort @keys;
+    my @splitters;
+    for my $i (1 .. $args{'buckets'}-1) {
+        last unless @keys;
+        my $key = $keys[int($i * scalar(@keys) / $args{'buckets'})];
+        push @splitters, $key if !@splitters or $key gt $splitters[-1];
+    }
+
+    my $file = sprintf("%s/range_splitters", $self->{'reactor'}->{'output_path'});
+    open(my $out, '>', $file) or return;
+    binmode($out);
+    print $out map { "$_\n" } @splitters;
+    close($out);
+
+    print STDERR "range partitioning into ".(scalar(@splitters)+1)." buckets\n" if $args{'verbose'};
+    return ($file, scalar(@splitters)+1);
+}
+
+
+# cmr-bucket spreads each hot key over a run of buckets and lists it in a .hot file. Once the buckets are reduced,
+# the rows of hot keys are split out of the buckets they were spread over, and only those rows are merged with the
+# combiner so each key's partial rows become one. Other buckets are left as they are.
+sub _recombine_hot_keys {
+    my ($self, $buckets, $num_buckets, $combine, $final) = @_;
+
+    my @hot_files = glob("$self->{'reactor'}->{'output_path'}/*.hot");
+    return $buckets unless @hot_files;
+
+    # Each hot key once, maps may have found the same ones
+    my %hot;
+    for my $file (@hot_files) {
+        open(my $fh, '<', $file) or next;
+        binmode($fh);
+        while ( my $line = <$fh> ) {
+            chomp $line;
+            my ($part, $fanout, $key) = $line =~ /^(\d+) (\d+) (.*)$/so or next;
+            $hot{$key} //= [$part, $fanout];
+        }
+        close($fh);
+        unlink($file);
+    }
+
+    my %salted;
+    for my $key (keys %hot) {
+        my ($part, $fanout) = @{$hot{$key}};
+        $salted{($part + $_) % $num_buckets} = 1 for (0 .. $fanout-1);
+    }
+
+    my $list = "$self->{'reactor'}->{'output_path'}/hot_keys";
+    open(my $out, '>', $list) or return $buckets;
+    binmode($out);
+    print $out map { "$hot{$_}->[0] $hot{$_}->[1] $_\n" } sort keys %hot;
+    close($out);
+    (my $list_path = $list) =~ s/^\Q$self->{'config'}->{'basepath'}\E//;
+
+    my (@kept, @split);
+    for my $i (0 .. $num_buckets-1) {
+        if ( $salted{$i} ) {
+            push @split, $buckets->[$i] // [];
+        }
+        else {
+            push @kept, $buckets->[$i] // [];
+        }
+    }
+
+    print STDERR "recombining ".scalar(keys %hot)." hot keys from ".scalar(@split)." buckets\n" if $self->{'config'}->{'verbose'};
+    my $rest = $self->merge_buckets('input'=>\@split, 'in_order'=>1, 'combine'=>$combine, 'prefix'=>'hot_split', 'final'=>$final, 'hot_keys'=>$list_path);
+    unlink($list);
+    return [ @kept, @$rest ] if $self->{'reactor'}->failed();
+
+    my @rows = glob("$self->{'reactor'}->{'output_path'}/hot_split-*.rows");
+    return [ @kept, @$rest ] unless @rows;
+    my $merged = $self->merge_buckets('input'=>[ \@rows ], 'in_order'=>1, 'combine'=>$combine, 'prefix'=>'hot_merge', 'final'=>$final);
+    return [ @kept, @$rest, @$merged ];
+}
+
+
 sub bucket_stream {
     my ($self, %kwargs) = @_;
 
@@ -721,7 +880,7 @@ sub bucket_stream {
         return $self->fail();
     }
 
-    my $map_id = 0;
+    my @batches;
     my @paths = _reduce_input_set($args{'input'});
     for my $path (@paths) {
     
@@ -729,38 +888,76 @@ sub bucket_stream {
         $path =~ s/^(?!$args{'basepath'})/$args{'basepath'}\//o;
         my $glob = $self->{'globber'}->PosixGlob($path);
         
-        while ( my ($ext, $batch) = $glob->next($batchsize) ) {
+        while ( my ($ext, $batch) = $glob->next($batchsize, ($args{'split_size'} // 0) * 1024 * 1024) ) {
             map { s/^$args{'basepath'}//o; $_; } @$batch;
+            push @batches, [$ext, $batch];
+        }
+    }
 
-            my $file = sprintf("%s/this_is_a_bit_of_a_hack", $self->{'reactor'}->{'output_path'});
+    # Range partitioned buckets hold consecutive key ranges, so the buckets concatenate into ordered output. Within a
+    # bucket that holds for merged rows and combined reducers, any other reducer writes its rows in its own order.
+    my $splitters;
+    if ( $args{'range_partition'} ) {
+        ($splitters, $args{'buckets'}) = $self->_range_splitters(\@batches, %args);
+        return $self->fail() if $self->{'reactor'}->failed() or not $splitters;
+        $splitters =~ s/^$args{'basepath'}//o;
+    }
 
-            $self->{'reactor'}->push({
-                'type'                  => &Cmr::Types::CMR_BUCKET,
-                'mapper'                => $args{'mapper'},
-                'buckets'               => $args{'buckets'},
-                'delimiter'             => $args{'delimiter'},
-                'input'                 => $batch,
-                'ext'                   => $ext,
-                'map_id'                => $map_id,
-                'destination'           => $file,
-            });
+    # A plain cmr-reduce reducer is folded into cmr-bucket and the merge, saving shuffle bytes and a pass over every
+    # bucket. Its rows reduce again, so hot keys can be salted over several buckets and combined afterwards.
+    my $combine = $args{'final_reducer'} ? undef : _combine_spec($args{'reducer'});
+    my $hot_keys = ( $combine and not $args{'range_partition'} ) ? $args{'hot_key_fanout'} : undef;
+    print STDERR "range partitioned buckets are ordered, the rows the reducer writes in each may not be\n" if $args{'range_partition'} and $args{'reducer'} and not $combine;
 
-            return $self->fail() if $self->{'reactor'}->failed();
-            $map_id++;
-        }
+    my $map_id = 0;
+    for my $entry (@batches) {
+        my ($ext, $batch) = @$entry;
+
+        my $file = sprintf("%s/this_is_a_bit_of_a_hack", $self->{'reactor'}->{'output_path'});
+
+        $self->{'reactor'}->push({
+            'type'                  => &Cmr::Types::CMR_BUCKET,
+            'mapper'                => $args{'mapper'},
+            'mapper_copies'         => $args{'mapper_copies'},
+            'mapper_ordered'        => $args{'mapper_ordered'},
+            'buckets'               => $args{'buckets'},
+            'delimiter'             => $args{'delimiter'},
+            'input'                 => $batch,
+            'ext'                   => $ext,
+            'map_id'                => $map_id,
+            'destination'           => $file,
+            'threads'               => $args{'bucket_threads'},
+            'splitters'             => $splitters,
+            'hot_keys'              => $hot_keys,
+            'combine'               => $combine,
+            'compress'              => $args{'compress_intermediate'},
+            'binary'                => $args{'binary_intermediate'},
+            'single_file'           => $args{'single_bucket_file'},
+        });
+
+        return $self->fail() if $self->{'reactor'}->failed();
+        $map_id++;
     }
 
     $self->{'reactor'}->sync();
     my @outputs = $self->{'reactor'}->get_job_output();
     $self->{'reactor'}->clear_job_output();
+    unlink("$args{'basepath'}/$splitters") if $splitters;
 
 
     # -- Merge files ( in order merge )
-    my $merged_buckets  = $self->merge_buckets('input'=>\@outputs, 'in_order'=>1);
+    # Without a reducer the merged buckets are the job's output
+    my $final = $args{'reducer'} ? 0 : 1;
+    my $merged_buckets  = $self->merge_buckets('input'=>\@outputs, 'in_order'=>1, 'combine'=>$combine, 'final'=>$final);
     return $self->fail() if $self->{'reactor'}->failed();
 
+    if ($hot_keys) {
+        $merged_buckets = $self->_recombine_hot_keys($merged_buckets, $args{'buckets'}, $combine, $final);
+        return $self->fail() if $self->{'reactor'}->failed();
+    }
+
     if ($args{'reducer'}) {
-        my $reduced_buckets = $self->reduce_buckets('input'=>$merged_buckets, 'reducer'=>$args{'reducer'}, 'final_reduce'=>1);
+        my $reduced_buckets = $combine ? $merged_buckets : $self->reduce_buckets('input'=>$merged_buckets, 'reducer'=>$args{'reducer'}, 'final_reduce'=>1);
         return $self->fail() if $self->{'reactor'}->failed();
 
         my @reduced_files;
@@ -771,7 +968,7 @@ sub bucket_stream {
         }
 
         print STDERR "merging output files\n" if $args{'verbose'};
-        if ( $args{'do_hierarchical_merge'} ) {
+        if ( $args{'do_hierarchical_merge'} and not $args{'range_partition'} ) {
             $self->hierarchical_merge("input"=>\@reduced_files);
             return $self->fail() if $self->{'reactor'}->failed();
         } else {
@@ -786,6 +983,62 @@ sub bucket_stream {
 }
 
 
+# Maps the semi_join input and ORs the Bloom filters of its join keys into one, shipped in the bundle path
+sub _join_bloom_filter {
+    my ($self, %args) = @_;
+
+    my $size = $args{'bloom_size'} // 16;
+    my $filter_id = 0;
+    for my $path (_reduce_input_set($args{'semi_join'})) {
+        my $batchsize = $args{'batch_size'} * $args{'batch_multiplier'};
+        $path =~ s/^(?!$args{'basepath'})/$args{'basepath'}\//o;
+        my $glob = $self->{'globber'}->PosixGlob($path);
+        while ( my ($ext, $batch) = $glob->next($batchsize, ($args{'split_size'} // 0) * 1024 * 1024) ) {
+            map { s/^$args{'basepath'}//o; $_; } @$batch;
+
+            $self->{'reactor'}->push({
+                'type'          =>  &Cmr::Types::CMR_STREAM,
+                'mapper'        =>  $args{'mapper'},
+                'mapper_copies' =>  $args{'mapper_copies'},
+                'mapper_ordered' =>  $args{'mapper_ordered'},
+                'reducer'       =>  "cmr-bucket --delimiter $args{'delimiter'} --join --build-bloom ${size}",
+                'input'         =>  $batch,
+                'ext'           =>  $ext,
+                'destination'   =>  sprintf("%s/bloom-%d", $self->{'reactor'}->{'output_path'}, $filter_id++),
+            });
+            return if $self->{'reactor'}->failed();
+        }
+    }
+
+    $self->{'reactor'}->sync();
+    my @filters = $self->{'reactor'}->get_job_output();
+    $self->{'reactor'}->clear_job_output();
+    return if $self->{'reactor'}->failed();
+
+    # An empty small side matches nothing
+    my $bloom = "\0" x ($size * 1024 * 1024);
+    for my $file (@filters) {
+        open(my $fh, '<', $file) or return;
+        binmode($fh);
+        my $bits = do { local $/; <$fh> };
+        close($fh);
+        $bloom |= $bits;
+    }
+    $self->cleanup('input'=>\@filters);
+    $self->{'reactor'}->sync();
+    $self->{'reactor'}->clear_job_output();
+
+    system("mkdir -p $self->{'config'}->{'bundle_path'}");
+    my $file = "$self->{'config'}->{'bundle_path'}/join.bloom";
+    open(my $out, '>', $file) or return;
+    binmode($out);
+    print $out $bloom;
+    close($out);
+
+    return $file;
+}
+
+
 sub bucket_join {
 my ($self, %kwargs) = @_;
 
@@ -804,6 +1057,13 @@ my ($self, %kwargs) = @_;
         print STDERR "\nJob failed: No output path specified\n";
         return $self->fail();
     }
+
+    # For an inner join, rows whose join key the smaller input doesn't have can be dropped before they're bucketed
+    my $bloom;
+    if ( $args{'semi_join'} ) {
+        $bloom = $self->_join_bloom_filter(%args);
+        return $self->fail() if $self->{'reactor'}->failed() or not $bloom;
+    }
     
     my $map_id = 0;
     my @paths = _reduce_input_set($args{'input'});
@@ -811,7 +1071,7 @@ my ($self, %kwargs) = @_;
         my $batchsize = $args{'batch_size'} * $args{'batch_multiplier'};
         $path =~ s/^(?!$args{'basepath'})/$args{'basepath'}\//o;
         my $glob = $self->{'globber'}->PosixGlob($path);
-        while ( my ($ext, $batch) = $glob->next($batchsize) ) {
+        while ( my ($ext, $batch) = $glob->next($batchsize, ($args{'split_size'} // 0) * 1024 * 1024) ) {
             map { s/^$args{'basepath'}//o; $_; } @$batch;
 
             my $not_a_real_file = sprintf("%s/this_is_a_bit_of_a_hack", $self->{'reactor'}->{'output_path'});
@@ -819,6 +1079,8 @@ my ($self, %kwargs) = @_;
             $self->{'reactor'}->push({
                 'type'          =>  &Cmr::Types::CMR_BUCKET,
                 'mapper'        =>  $args{'mapper'},
+                'mapper_copies' =>  $args{'mapper_copies'},
+                'mapper_ordered' =>  $args{'mapper_ordered'},
                 'buckets'       =>  $args{'num_buckets'},
                 'delimiter'     =>  $args{'delimiter'},
                 'join'          =>  1,
@@ -827,6 +1089,11 @@ my ($self, %kwargs) = @_;
                 'map_id'        =>  $map_id,
                 'destination'   =>  $not_a_real_file,
                 'prefix'        => 'bucket',
+                'threads'       =>  $args{'bucket_threads'},
+                'bloom'         =>  $bloom,
+                'compress'      =>  $args{'compress_intermediate'},
+                'binary'        =>  $args{'binary_intermediate'},
+                'single_file'   =>  $args{'single_bucket_file'},
             });
 
             $self->fail() if $self->{'reactor'}->failed();
@@ -872,6 +1139,10 @@ my ($self, %kwargs) = @_;
             'map_id'        =>  $map_id,
             'destination'   =>  $not_a_real_file,
             'prefix'        => 'rebucket',
+            'threads'       =>  $args{'bucket_threads'},
+            'compress'      =>  $args{'compress_intermediate'},
+            'binary'        =>  $args{'binary_intermediate'},
+            'single_file'   =>  $args{'single_bucket_file'},
         });
 
         $self->fail() if $self->{'reactor'}->failed();
@@ -883,12 +1154,13 @@ my ($self, %kwargs) = @_;
     $self->{'reactor'}->clear_job_output();
 
     # -- Merge files ( in order merge )
-    $merged_buckets  = $self->merge_buckets('input'=>\@outputs, 'in_order'=>1);
+    my $combine = $args{'final_reducer'} ? undef : _combine_spec($args{'reducer'});
+    $merged_buckets  = $self->merge_buckets('input'=>\@outputs, 'in_order'=>1, 'combine'=>$combine);
     return $self->fail() if $self->{'reactor'}->failed();
 
     # -- Reduce files :
-    # For each secondary key range invoke the join-reducer
-    $reduced_buckets = $self->reduce_buckets('input'=>$merged_buckets, 'reducer'=>$args{'reducer'}, 'prefix'=>'final_reduce', 'final_reduce'=>1);
+    # For each secondary key range invoke the join-reducer (already done by the merge for a plain cmr-reduce)
+    $reduced_buckets = $combine ? $merged_buckets : $self->reduce_buckets('input'=>$merged_buckets, 'reducer'=>$args{'reducer'}, 'prefix'=>'final_reduce', 'final_reduce'=>1);
     return $self->fail() if $self->{'reactor'}->failed();
 
     @reduced_files = ();
@@ -925,9 +1197,12 @@ sub cleanup {
     my %args = ( %defaults, %{$self->{'config'}}, %kwargs );
 
     my $part_id = 0;
-    my @input = @{$args{'input'}};
     my $index = 0;
 
+    # Partitions of a single bucket file (file#partition) all go with the file
+    my %seen;
+    my @input = grep { !$seen{$_}++ } map { (my $file = $_) =~ s/#\d+$//o; $file } @{$args{'input'}};
+
     unless ( $self->{'reactor'}->{'output_path'} ) {
         print STDERR "Job failed: No output path specified\n";
         return;
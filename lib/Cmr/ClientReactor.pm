@@ -218,6 +218,7 @@ sub new {
         'pid'                   => $pid,
         'backlog'               => Thread::Queue->new,
         'warnings'              => 0,
+        'stage_stats'           => {},
     };
 
     share($obj->{'lock'});
@@ -228,6 +229,7 @@ sub new {
     share($obj->{'num_tasks_submitted'});
     share($obj->{'num_tasks_completed'});
     share($obj->{'warnings'});
+    share(%{$obj->{'stage_stats'}});
 
     $obj->{'thread'} = threads->create(\&thread_main, $obj),
 
@@ -307,6 +309,8 @@ sub finish {
         close($self->{'err_fd'});
     }
 
+    print_stage_stats($self) if $self->{'config'}->{'verbose'};
+
     if ( $self->{'config'}->{'no_output_dir'} ) {
         # Special case - no output generated
     }
@@ -682,6 +686,19 @@ sub finish_task {
         } # unlock
     }
 
+    # Totals per pipeline stage over the job's tasks, from the workers' cmr-pipe reports
+    if ( $comp->{'stages'} ) {
+        lock $self->{'lock'};
+        for my $stage (@{$comp->{'stages'}}) {
+            my $totals = $self->{'stage_stats'}->{$stage->{'name'}} //= shared_clone({ 'tasks' => 0, 'wall' => 0, 'user' => 0, 'sys' => 0, 'maxrss' => 0, 'in' => 0, 'out' => 0, 'blocked' => 0 });
+            $totals->{'tasks'}++;
+            for my $key ('wall', 'user', 'sys', 'in', 'out', 'blocked') {
+                $totals->{$key} += $stage->{$key} if $stage->{$key} and $stage->{$key} > 0;
+            }
+            $totals->{'maxrss'} = $stage->{'maxrss'} if $stage->{'maxrss'} and $stage->{'maxrss'} > $totals->{'maxrss'};
+        }
+    }
+
     if ( $comp->{'errors'} and $self->{'num_task_errors'} < $self->{'config'}->{'max_task_errors'} ) {
         my $error_prefix = "Encountered errors during $Cmr::Types::Task->{$task->{'type'}} task\n";
         if ($task->{'input'}) {
@@ -714,6 +731,21 @@ sub finish_task {
 }
 
 
+sub print_stage_stats {
+    my ($self) = @_;
+    my $stats = $self->{'stage_stats'};
+    return unless %$stats;
+
+    print STDERR "Where the time went (seconds summed over tasks, largest RSS, MB read and written, seconds waiting on the next stage):\n";
+    printf STDERR "%-24s %8s %10s %10s %10s %10s %12s %12s %10s\n", 'stage', 'tasks', 'wall', 'user', 'sys', 'maxrss', 'in', 'out', 'blocked';
+    for my $name (sort { $stats->{$b}->{'wall'} <=> $stats->{$a}->{'wall'} } keys %$stats) {
+        my $s = $stats->{$name};
+        printf STDERR "%-24s %8d %10.1f %10.1f %10.1f %9dM %12.1f %12.1f %10.1f\n", substr($name, 0, 24), $s->{'tasks'},
+            $s->{'wall'}, $s->{'user'}, $s->{'sys'}, $s->{'maxrss'} / 1024, $s->{'in'} / 1048576, $s->{'out'} / 1048576, $s->{'blocked'};
+    }
+}
+
+
 sub resubmit_task {
     my ($self, $comp, $task) = @_;
 
@@ -91,6 +91,7 @@ sub RegexpGlob {
     my $glob = bless({
       'globber' => $self,
       'id'      => $id,
+      'splits'  => [],
     });
 
     my %exts : shared = ();
@@ -113,6 +114,7 @@ sub PosixGlob {
     my $glob = bless({
       'globber' => $self,
       'id'      => $id,
+      'splits'  => [],
     });
 
     my %exts : shared = ();
@@ -191,10 +193,27 @@ sub _GLOB_MAIN {
   }
 }
 
+# Queue line aligned byte ranges (file:offset:length, read by chunky) for a plain file bigger than split_size
+sub _split {
+  my ($self, $file, $split_size) = @_;
+  my $size = -s $file;
+  return 0 unless $size and $size > $split_size;
+
+  for (my $offset = 0; $offset < $size; $offset += $split_size) {
+    push @{$self->{'splits'}}, "${file}:${offset}:${split_size}";
+  }
+  return 1;
+}
+
+# With a split_size large plain files come back one byte range per batch instead of whole
 sub next {
-  my ($self, $batchsize) = @_;
+  my ($self, $batchsize, $split_size) = @_;
   $batchsize //= 1;
 
+  if ( @{$self->{'splits'}} ) {
+    return "uncompressed", [shift @{$self->{'splits'}}];
+  }
+
   my $globber = $self->{'globber'};
   my @batch = ();
 
@@ -230,6 +249,11 @@ sub next {
     Time::HiRes::nanosleep(0.01*1e9);
   }
 
+  if ( $split_size and scalar(@batch) and $cur_ext eq "uncompressed" ) {
+    @batch = grep { !$self->_split($_, $split_size) } @batch;
+    return $self->next($batchsize, $split_size) unless @batch;
+  }
+
   if (scalar(@batch)) {
     return $cur_ext, \@batch;
   }
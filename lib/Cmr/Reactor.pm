@@ -74,6 +74,7 @@ sub task_finished;
 sub thread_finished;
 sub stop_threads;
 sub start_threads;
+sub placement;
 
 sub thread_main {
     my ($args) = @_;
@@ -89,6 +90,7 @@ sub thread_main {
         'id'            => $id,
         'backlog'       => $backlog,
     };
+    @{$self}{'cpus', 'node'} = placement($config, $id);
 
     $args->{'thread_init'}->($self, $config) if $args->{'thread_init'};
 
@@ -106,6 +108,7 @@ sub thread_main {
         }
         elsif ( $task->{&MAGIC} == CONFIG_CHANGED ) {
             $config = $task->{'config'};
+            @{$self}{'cpus', 'node'} = placement($config, $id);
             next;
         }
         elsif ( $task->{&MAGIC} == END_THREAD  ) {
@@ -461,4 +464,83 @@ sub stop_threads {
     }
 }
 
+# CPUs in a kernel list, "0-3,8,10-11"
+sub parse_cpulist {
+    my ($list) = @_;
+    my @cpus;
+    for my $range (split(/,/, $list)) {
+        my ($first, $last) = $range =~ /^(\d+)(?:-(\d+))?$/o or next;
+        CORE::push @cpus, ($first .. ($last // $first));
+    }
+    return @cpus;
+}
+
+# CPUs in a kernel list file
+sub read_cpulist {
+    my ($path) = @_;
+    open(my $fh, '<', $path) or return ();
+    my $list = <$fh> // '';
+    close($fh);
+    chomp $list;
+    return parse_cpulist($list);
+}
+
+# CPUs this process may run on (its cpuset or taskset), or nothing when the kernel doesn't say
+sub allowed_cpus {
+    open(my $fh, '<', '/proc/self/status') or return ();
+    my @cpus;
+    while (my $line = <$fh>) {
+        if ($line =~ /^Cpus_allowed_list:\s*(\S+)/o) {
+            @cpus = parse_cpulist($1);
+            last;
+        }
+    }
+    close($fh);
+    return @cpus;
+}
+
+# Allowed CPUs of each NUMA node, or all of them as node 0 when the kernel has no nodes to show
+sub numa_nodes {
+    my %allowed = map { $_ => 1 } allowed_cpus();
+    my $usable = sub { return %allowed ? grep { $allowed{$_} } @_ : @_; };
+
+    my @nodes;
+    for my $dir (glob('/sys/devices/system/node/node[0-9]*')) {
+        my ($node) = $dir =~ /(\d+)$/o;
+        my @cpus = $usable->(read_cpulist("${dir}/cpulist"));
+        CORE::push @nodes, { 'node' => $node, 'cpus' => \@cpus } if @cpus;
+    }
+    if (!@nodes) {
+        my @cpus = $usable->(read_cpulist('/sys/devices/system/cpu/online'));
+        CORE::push @nodes, { 'node' => 0, 'cpus' => \@cpus } if @cpus;
+    }
+    return sort { $a->{'node'} <=> $b->{'node'} } @nodes;
+}
+
+# With cpu_placement, where a thread's pipelines run: threads are dealt out to NUMA nodes in turn and split
+# their node's CPUs between them, so no two threads share a CPU unless there are more threads than CPUs.
+# Returns the CPU list and node for cmr-pipe, or nothing.
+sub placement {
+    my ($config, $id) = @_;
+    return () unless $config->{'cpu_placement'};
+
+    my @nodes = numa_nodes();
+    return () unless @nodes;
+
+    my $threads = $config->{'max_threads'} || 4;
+    my $node = $nodes[$id % @nodes];
+    my $rank = int($id / @nodes);
+    my $peers = int(($threads - 1 - $id % @nodes) / @nodes) + 1;
+    my @cpus = @{$node->{'cpus'}};
+
+    if ($rank >= $peers || $peers >= @cpus) {
+        return ($cpus[$rank % @cpus], $node->{'node'});
+    }
+    my $per = int(@cpus / $peers);
+    my $extra = @cpus % $peers;
+    my $first = $rank * $per + ($rank < $extra ? $rank : $extra);
+    my $count = $per + ($rank < $extra ? 1 : 0);
+    return (join(',', @cpus[$first .. $first + $count - 1]), $node->{'node'});
+}
+
 1;
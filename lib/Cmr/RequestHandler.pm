@@ -28,6 +28,8 @@ use warnings;
 
 use Time::HiRes qw(gettimeofday);
 use IPC::Open3;
+use File::Temp ();
+use threads::shared;
 use Cmr::StartupUtils ();
 
 use File::Basename qw(dirname);
@@ -36,6 +38,9 @@ use lib dirname (abs_path(__FILE__));
 
 use Cmr::Types;
 
+# cmr-pipe options from the worker's configuration, set per request
+our %pipe_config;
+
 sub new($$) {
     my ($class, $queue) = @_;
     my $self = {};
@@ -59,6 +64,10 @@ sub handle_request($$$$) {
 
     $task->{'result'} = &Cmr::Types::CMR_RESULT_FAILURE;
 
+    %pipe_config = map { $_ => $config->{$_} } ('pipe_size', 'pipe_relay', 'pipe_builtins');
+    $pipe_config{'cpus'} = $reactor->{'cpus'};
+    $pipe_config{'membind'} = $reactor->{'node'} if $config->{'numa_membind'};
+
     # Setup output paths
     my $out_file = sprintf("%s/%s", $config->{'basepath'}, $task->{'destination'});
     my $out_path = $out_file;
@@ -92,11 +101,14 @@ sub handle_request($$$$) {
             $input .= sprintf("%s/%s ", $config->{'basepath'}, $file);
             next if $task->{'type'} == &Cmr::Types::CMR_CLEANUP;
 
+            # Split inputs carry a :offset:length byte range for chunky, bucket partitions a #partition
+            (my $path = $file) =~ s/(:\d+:\d+|#\d+)$//o;
+
             # More Working around some gluster issues (client desync)
             my $more_retries = 30;
-            while ( $more_retries > 0 && !(-e "$config->{'basepath'}/$file") ) {
+            while ( $more_retries > 0 && !(-e "$config->{'basepath'}/$path") ) {
               $more_retries--;
-              system("ls -l $config->{'basepath'}/$file > /dev/null 2>&1");
+              system("ls -l $config->{'basepath'}/$path > /dev/null 2>&1");
               Time::HiRes::nanosleep(0.1*1e9);
             }
 
@@ -120,14 +132,97 @@ sub handle_request($$$$) {
     return;
 }
 
+# Leading stages of a pipeline reading the task input
+# Formats configured as "chunky <flags>" are decoded by the input chunky itself rather than a separate stage
+sub input_cmds {
+    my ($task, $input) = @_;
+    my @cmds;
+
+    my $fmt = $task->{'in_fmt_cmd'};
+
+    # cmr-pipe's builtins read whole files only, not byte ranges or partitions
+    if ( $pipe_config{'pipe_builtins'} and ${input} !~ /(:\d+:\d+|#\d+)(\s|$)/o ) {
+        if ( !$fmt ) {
+            push @cmds, "cmr:cat ${input}";
+            return @cmds;
+        }
+        if ( $fmt =~ /^(gzip -dc|gunzip -c|zcat)$/o ) {
+            push @cmds, "cmr:zcat ${input}";
+            return @cmds;
+        }
+    }
+
+    if ( $fmt and $fmt =~ /^chunky\s+(.*)$/o ) {
+        push @cmds, "chunky -s 16 --dontneed $1 ${input}";
+    }
+    else {
+        push @cmds, "chunky -s 16 --zero-copy --prefetch 4 --dontneed ${input}";
+        push @cmds, "${fmt}" if $fmt;
+    }
+
+    return @cmds;
+}
+
+# The mapper stage, as copies run by cmr-pipe (--CMR_PARALLEL) if the job asks for them
+sub mapper_cmd {
+    my ($task) = @_;
+    my $cmd = "$task->{'mapper'} --CMR_NAME mapper";
+    if ( ($task->{'mapper_copies'} // 1) > 1 ) {
+        $cmd .= " --CMR_PARALLEL $task->{'mapper_copies'}";
+        $cmd .= " --CMR_ORDERED" if $task->{'mapper_ordered'};
+    }
+    return $cmd;
+}
+
+# Last stage of a pipeline, gathering its output into large writes
+sub output_cmd {
+    my ($compress) = @_;
+    return "cmr:write -s 16 --dontneed" if $pipe_config{'pipe_builtins'} and !$compress;
+    return "chunky -s 16 --double-buffer --dontneed ${compress}";
+}
+
+# Per process report from cmr-pipe --CMR_PIPE_STATS, a hash of its numbers (and name) per pipeline stage
+sub read_stats {
+    my ($file) = @_;
+    my @stages;
+    open(my $fh, '<', $file) or return;
+    while (my $line = <$fh>) {
+        chomp $line;
+        my ($name, @fields) = split(/\t/o, $line);
+        my %stage = ( 'name' => $name );
+        for my $field (@fields) {
+            my ($key, $value) = split(/=/o, $field, 2);
+            $stage{$key} = $value + 0;
+        }
+        push @stages, \%stage;
+    }
+    close($fh);
+    return \@stages;
+}
+
 sub task_exec {
     my ($task, $cmd) = @_;
     my $rc;
 
+    # Where the time went, sent back with the completion event
+    my ($stats_fh, $stats_file) = File::Temp::tempfile('cmr-pipe-stats-XXXXXX', TMPDIR => 1);
+    close($stats_fh);
+    my $pipe_opts = "--CMR_PIPE_STATS ${stats_file}";
+    $pipe_opts .= " --CMR_PIPE_SIZE $pipe_config{'pipe_size'}" if $pipe_config{'pipe_size'};
+    $pipe_opts .= " --CMR_PIPE_RELAY" if $pipe_config{'pipe_relay'};
+    $pipe_opts .= " --CMR_PIPE_CPUS $pipe_config{'cpus'}" if defined $pipe_config{'cpus'};
+    $pipe_opts .= " --CMR_PIPE_MEMBIND $pipe_config{'membind'}" if defined $pipe_config{'membind'};
+    my $stats = $cmd =~ s/\bcmr-pipe /cmr-pipe ${pipe_opts} /;
+
     {
         my $result = `$cmd`;
         $rc = $? >> 8;
 
+        if ($stats and my $stages = read_stats($stats_file)) {
+            $task->{'stages'} = shared_clone($stages);
+        }
+        unlink($stats_file);
+
         if ($result) {
             $task->{'warnings'} = 1;
             $task->{'errors'} = substr( $result, 0, 65536 ) . "\n";
@@ -29,6 +29,23 @@ use warnings;
 use threads;
 use threads::shared;
 
+# Offsets of the partitions in a cmr-bucket --single-file output (see src/partfile.h),
+# the last entry is where the final partition ends
+sub partition_offsets {
+    my ($file) = @_;
+    open(my $fh, '<', $file) or return;
+    binmode($fh);
+    my $size = -s $fh;
+    my $trailer;
+    return unless $size >= 8 && sysseek($fh, $size - 8, 0) && sysread($fh, $trailer, 8) == 8;
+    my ($parts, $magic) = unpack("V a4", $trailer);
+    return unless $magic eq 'CMRP' && $size >= 8 + 8 * ($parts+1);
+    my $index;
+    return unless sysseek($fh, $size - 8 - 8 * ($parts+1), 0) && sysread($fh, $index, 8 * ($parts+1)) == 8 * ($parts+1);
+    close($fh);
+    return unpack("Q<*", $index);
+}
+
 sub handle_request_local {
     my ($self, $task, $config, $input, $output) = @_;
     return &Cmr::Types::CMR_RESULT_SUCCESS unless ${input};
@@ -38,26 +55,30 @@ sub handle_request_local {
     my @cmds;
 
     
-    push @cmds, "chunky -s 16 ${input}";
+    push @cmds, &Cmr::RequestHandler::input_cmds($task, ${input});
 
     $task->{'prefix'} //= 'bucket';
-
-    if ( $task->{'in_fmt_cmd'} ) {
-        push @cmds, "$task->{'in_fmt_cmd'} ";
-    }
+    my $threads = $task->{'threads'} // 1;
+    my $range = $task->{'splitters'} ? "--range-partition $config->{'basepath'}/$task->{'splitters'}" : "";
+    my $hot_keys = $task->{'hot_keys'} ? "--hot-keys $task->{'hot_keys'}" : "";
+    my $combine = $task->{'combine'} ? "--combine $task->{'combine'}" : "";
+    my $bloom = $task->{'bloom'} ? "--bloom $task->{'bloom'}" : "";
+    my $compress = $task->{'compress'} ? "--compress" : "";
+    my $binary = $task->{'binary'} ? "--binary" : "";
+    my $single_file = $task->{'single_file'} ? "--single-file" : "";
 
     if ($task->{'mapper'}) {
-        push @cmds, "$task->{'mapper'} --CMR_NAME mapper";
+        push @cmds, &Cmr::RequestHandler::mapper_cmd($task);
     }
 
     if ($task->{'join'}) {
-        push @cmds, "cmr-bucket --delimiter $task->{'delimiter'} --sort --join --num-partitions $task->{'buckets'} --destination $task->{'out_path'} --map-id $task->{'map_id'} --prefix $task->{'prefix'}";
+        push @cmds, "cmr-bucket --delimiter $task->{'delimiter'} --sort --join --threads ${threads} ${bloom} ${compress} ${binary} ${single_file} --num-partitions $task->{'buckets'} --destination $task->{'out_path'} --map-id $task->{'map_id'} --prefix $task->{'prefix'}";
     }
     elsif ($task->{'strip_joinkey'}) {
-        push @cmds, "cmr-bucket --delimiter $task->{'delimiter'} --sort --strip-joinkey --num-partitions $task->{'buckets'} --destination $task->{'out_path'} --map-id $task->{'map_id'} --prefix $task->{'prefix'}";
+        push @cmds, "cmr-bucket --delimiter $task->{'delimiter'} --sort --strip-joinkey --threads ${threads} ${compress} ${binary} ${single_file} --num-partitions $task->{'buckets'} --destination $task->{'out_path'} --map-id $task->{'map_id'} --prefix $task->{'prefix'}";
     }
     else {
-        push @cmds, "cmr-bucket --delimiter $task->{'delimiter'} --sort --num-partitions $task->{'buckets'} --destination $task->{'out_path'} --map-id $task->{'map_id'} --prefix $task->{'prefix'}";
+        push @cmds, "cmr-bucket --delimiter $task->{'delimiter'} --sort --threads ${threads} ${range} ${hot_keys} ${combine} ${compress} ${binary} ${single_file} --num-partitions $task->{'buckets'} --destination $task->{'out_path'} --map-id $task->{'map_id'} --prefix $task->{'prefix'}";
     }
 
     my $timeout = $task->{'deadline'} - Time::HiRes::gettimeofday;
@@ -67,15 +88,23 @@ print STDERR "CMD: $cmd\n";
     my $rc = &Cmr::RequestHandler::task_exec($task, $cmd);
 
     # The client doesn't know which files will have been generated by the cmr-bucket
-    # Determine which files exist from the possible output set
+    # With a single file its index says which partitions have data, otherwise check the possible output set
+    $task->{'bucket_destinations'} //= shared_clone([]);
+    my @offsets;
+    my $file = sprintf("%s/%s-%d", $task->{'out_path'}, $task->{'prefix'}, $task->{'map_id'});
+    @offsets = partition_offsets($file) if $task->{'single_file'} && $rc == 0;
     for my $part_id (0 .. $task->{'buckets'}-1) {
-        my $destination = sprintf("%s/%s-%d-0-%d", $task->{'out_path'}, $task->{'prefix'}, $task->{'map_id'}, $part_id);
-        $task->{'bucket_destinations'} //= shared_clone([]);
         $task->{'bucket_destinations'}->[$part_id] //= shared_clone ([]);
 
-        if (-e $destination) {
-            # Possible optimization, bucket destinations could be stored significantly more compactly by omitting constant parts of the path
-            push $task->{'bucket_destinations'}->[$part_id], $destination;
+        # Possible optimization, bucket destinations could be stored significantly more compactly by omitting constant parts of the path
+        if ($task->{'single_file'}) {
+            if (@offsets > $part_id + 1 && $offsets[$part_id+1] > $offsets[$part_id]) {
+                push @{$task->{'bucket_destinations'}->[$part_id]}, "${file}#${part_id}";
+            }
+        }
+        else {
+            my $destination = sprintf("%s/%s-%d-%d", $task->{'out_path'}, $task->{'prefix'}, $task->{'map_id'}, $part_id);
+            push @{$task->{'bucket_destinations'}->[$part_id]}, $destination if -e $destination;
         }
     }
 
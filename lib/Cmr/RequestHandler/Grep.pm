@@ -37,6 +37,12 @@ sub handle_request_local {
     my $flags = $task->{'flags'} // [];
     my $grep = "grep " . join(' ', @{$flags} );
 
+    # cmr-pipe's builtin grep takes fixed strings, and -v
+    my $fixed = !grep { /[\\.\[\]*^\$]/o } @{$task->{'patterns'}};
+    if ( $Cmr::RequestHandler::pipe_config{'pipe_builtins'} and $fixed and join(' ', @{$flags}) =~ /^(-v)?$/o ) {
+        $grep = "cmr:grep " . join(' ', @{$flags} );
+    }
+
     for my $pattern (@{$task->{'patterns'}}) {
         $grep .= " -e '$pattern' ";
     }
@@ -45,14 +51,10 @@ sub handle_request_local {
     my @cmds;
 
     # Here chunky is added to the command pipeline to force large read/writes [16mb]
-    push @cmds, "chunky -s 16 ${input}";
-
-    if ( $task->{'in_fmt_cmd'} ) {
-        push @cmds, "$task->{'in_fmt_cmd'}";
-    }
+    push @cmds, &Cmr::RequestHandler::input_cmds($task, ${input});
 
     push @cmds, "$grep";
-    push @cmds, "chunky -s 16";
+    push @cmds, &Cmr::RequestHandler::output_cmd("");
 
     my $timeout = $task->{'deadline'} - Time::HiRes::gettimeofday;
     if ($timeout < 0) { return $result; }
@@ -36,12 +36,21 @@ sub handle_request_local {
     my $timeout = $task->{'deadline'} - Time::HiRes::gettimeofday;
     if ($timeout < 0) { return $result; }
 
+    # Intermediate outputs may be compressed, whatever reads them (chunky, cmr-merge) decodes them again
+    my $compress = $task->{'compress'} ? "--compress" : "";
+
     my $cmd;
     if ($task->{'in_order'}) {
-        $cmd = "timeout -s KILL ${timeout} cmr-pipe --CMR_PIPE_UID $task->{'uid'} --CMR_PIPE_GID $task->{'gid'} cmr-merge --delimiter $task->{'delimiter'} ${input} : chunky -s 16 --CMR_PIPE_OUT ${output}";
+        # Reducing while merging, one row per key comes out
+        my $combine = $task->{'combine'} ? "--combine $task->{'combine'}" : "";
+        my $threads = $task->{'threads'} // 1;
+        my $binary = $task->{'binary'} ? "--binary" : "";
+        # Rows of hot keys are split out to a file of their own next to the output
+        my $hot_keys = $task->{'hot_keys'} ? "--hot-keys $config->{'basepath'}/$task->{'hot_keys'} --hot-out ${output}.rows" : "";
+        $cmd = "timeout -s KILL ${timeout} cmr-pipe --CMR_PIPE_UID $task->{'uid'} --CMR_PIPE_GID $task->{'gid'} cmr-merge --delimiter $task->{'delimiter'} ${combine} --threads ${threads} ${binary} ${hot_keys} ${input} : " . &Cmr::RequestHandler::output_cmd(${compress}) . " --CMR_PIPE_OUT ${output}";
     }
     else {
-        $cmd = "timeout -s KILL ${timeout} cmr-pipe --CMR_PIPE_UID $task->{'uid'} --CMR_PIPE_GID $task->{'gid'} chunky -s 4 ${input} : chunky -s 16 --CMR_PIPE_OUT ${output}";
+        $cmd = "timeout -s KILL ${timeout} cmr-pipe --CMR_PIPE_UID $task->{'uid'} --CMR_PIPE_GID $task->{'gid'} chunky -s 4 --zero-copy --prefetch 4 --dontneed ${input} : " . &Cmr::RequestHandler::output_cmd(${compress}) . " --CMR_PIPE_OUT ${output}";
     }
 
     my $rc = &Cmr::RequestHandler::task_exec($task, $cmd);
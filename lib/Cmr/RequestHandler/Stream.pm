@@ -35,20 +35,19 @@ sub handle_request_local {
 
     # Build command pipeline
     my @cmds;
-    push @cmds, "chunky -s 16 ${input}";
-    if ( $task->{'in_fmt_cmd'} ) { 
-        push @cmds, "$task->{'in_fmt_cmd'} ";
-    }
+    push @cmds, &Cmr::RequestHandler::input_cmds($task, ${input});
 
     if ($task->{'mapper'}) {
-        push @cmds, "$task->{'mapper'} --CMR_NAME mapper";
+        push @cmds, &Cmr::RequestHandler::mapper_cmd($task);
     }
 
     if ($task->{'reducer'}) {
         push @cmds, "$task->{'reducer'} --CMR_NAME reducer";
     }
 
-    push @cmds, "chunky -s 16";
+    # Intermediate outputs may be compressed, whatever reads them (chunky, cmr-merge) decodes them again
+    my $compress = $task->{'compress'} ? "--compress" : "";
+    push @cmds, &Cmr::RequestHandler::output_cmd(${compress});
 
     my $timeout = $task->{'deadline'} - Time::HiRes::gettimeofday;
     if ($timeout < 0) { return $result; }
@@ -22,23 +22,839 @@
 #include <fcntl.h>
 #include <glob.h>
 #include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "cmz.h"
+#include "cmb.h"
+#include "cmtext.h"
+#include "partfile.h"
 
 static struct option long_options[] = {
-    {.name = "size",     .has_arg = required_argument, .flag = 0, .val = 's'},
+    {.name = "size",      .has_arg = required_argument, .flag = 0, .val = 's'},
+    {.name = "zero-copy", .has_arg = no_argument,       .flag = 0, .val = 'z'},
+    {.name = "verbose",   .has_arg = no_argument,       .flag = 0, .val = 'v'},
+    {.name = "prefetch",  .has_arg = required_argument, .flag = 0, .val = 'p'},
+    {.name = "gunzip",    .has_arg = no_argument,       .flag = 0, .val = 'g'},
+    {.name = "threads",   .has_arg = required_argument, .flag = 0, .val = 't'},
+    {.name = "double-buffer", .has_arg = no_argument,   .flag = 0, .val = 'd'},
+    {.name = "direct",    .has_arg = no_argument,       .flag = 0, .val = 'D'},
+    {.name = "dontneed",  .has_arg = no_argument,       .flag = 0, .val = 'n'},
+    {.name = "compress",  .has_arg = no_argument,       .flag = 0, .val = 'c'},
     {0,0,0,0},
 };
-static char short_options[] = "s:";
+static char short_options[] = "s:zvp:gt:dDnc";
+
+#define MAX_PREFETCH 64
+#define PREFETCH_HEAD (1024*1024)
+#define DIRECT_ALIGN 4096
+
+// Ways of moving bytes from an input to stdout
+enum { XFER_BUFFERED = 0, XFER_SPLICE, XFER_COPY_FILE_RANGE, XFER_SENDFILE, XFER_METHODS };
+static const char* xfer_names[XFER_METHODS] = { "buffered", "splice", "copy_file_range", "sendfile" };
+static long long xfer_bytes[XFER_METHODS];
 
 int null_stat (const char *path, struct stat *buf) {
     return 0;
 }
 
+static int fd_mode(int fd) {
+    struct stat st;
+    if ( fstat(fd, &st) != 0 ) { return 0; }
+    return st.st_mode & S_IFMT;
+}
+
+// Pick a kernel side transfer for in -> out
+// Pipe -> file stays buffered, splicing it would turn our large writes into pipe sized ones
+static int pick_xfer(int in, int out) {
+    int in_mode = fd_mode(in);
+    int out_mode = fd_mode(out);
+
+    if ( out_mode == S_IFIFO && ( in_mode == S_IFIFO || in_mode == S_IFREG ) ) { return XFER_SPLICE; }
+    if ( in_mode == S_IFREG && out_mode == S_IFREG ) { return XFER_COPY_FILE_RANGE; }
+    if ( in_mode == S_IFREG && out_mode != S_IFIFO ) { return XFER_SENDFILE; }
+    return XFER_BUFFERED;
+}
+
+// Move everything left in `in` (at most limit bytes, < 0 for no limit) to `out` without bouncing it through user space, chunk bytes per call
+// Returns -1 if the kernel refused before anything moved (caller falls back), -2 on a real error
+static int kernel_xfer(int method, int in, int out, size_t chunk, long long limit) {
+    long long moved = 0;
+
+    while (1) {
+        ssize_t n = 0;
+        if ( limit >= 0 ) {
+            if ( moved >= limit ) { break; }
+            if ( limit - moved < chunk ) { chunk = limit - moved; }
+        }
+        switch (method) {
+            case XFER_SPLICE:
+                n = splice(in, NULL, out, NULL, chunk, SPLICE_F_MOVE|SPLICE_F_MORE);
+                break;
+            case XFER_COPY_FILE_RANGE:
+                n = copy_file_range(in, NULL, out, NULL, chunk, 0);
+                if ( n < 0 && moved == 0 && ( errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP ) ) {
+                    // Cross filesystem (or old kernel), sendfile can still keep it out of user space
+                    method = XFER_SENDFILE;
+                    continue;
+                }
+                break;
+            case XFER_SENDFILE:
+                n = sendfile(out, in, NULL, chunk);
+                break;
+        }
+
+        if ( n == 0 ) { break; }
+        if ( n < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            // copy_file_range refuses an out opened O_APPEND (>>) with EBADF, sendfile wouldn't take it either
+            if ( moved == 0 && method == XFER_COPY_FILE_RANGE && errno == EBADF ) { return -1; }
+            if ( moved == 0 && ( errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP ) ) { return -1; }
+            fprintf(stderr, "chunky: %s failed: %s\n", xfer_names[method], strerror(errno));
+            return -2;
+        }
+        moved += n;
+        xfer_bytes[method] += n;
+    }
+    return 0;
+}
+
+// Inputs may name a byte range as path:offset:length. As with Hadoop splits a range holds every line
+// starting inside it, so the ranges of a file put each of its lines out exactly once.
+// path#partition names one partition of a cmr-bucket --single-file output instead.
+typedef struct input_range_t {
+    off_t offset;
+    off_t length; // < 0 for the whole file
+    int part;     // < 0 unless a partition was named
+} input_range;
+
+static input_range* ranges;
+
+// Split a trailing :offset:length off arg, returns the path to glob
+static char* parse_range(char* arg, input_range* r) {
+    r->offset = 0;
+    r->length = -1;
+    r->part = partfile_split(arg);
+
+    char* len = strrchr(arg, ':');
+    if ( !len || len == arg ) { return arg; }
+    char* off = len - 1;
+    while ( off > arg && *off != ':' ) { off--; }
+    if ( *off != ':' || off+1 == len || len[1] == '\0' ) { return arg; }
+    if ( strspn(off+1, "0123456789") != len - off - 1 || strspn(len+1, "0123456789") != strlen(len+1) ) { return arg; }
+
+    r->offset = strtoll(off+1, NULL, 10);
+    r->length = strtoll(len+1, NULL, 10);
+    return strndup(arg, off - arg);
+}
+
+// Offset just past the first newline at or after pos, or where the file ends
+static off_t line_end(int fd, off_t pos) {
+    char buf[65536];
+    while (1) {
+        ssize_t rd = pread(fd, buf, sizeof(buf), pos);
+        if ( rd < 0 && errno == EINTR ) { continue; }
+        if ( rd <= 0 ) { return pos; }
+        char* nl = (char*)memchr(buf, '\n', rd);
+        if ( nl ) { return pos + (nl - buf) + 1; }
+        pos += rd;
+    }
+}
+
+// Open an input positioned at the first line of its range, *remaining is set to the bytes it covers (-1 for all of it)
+static int open_input(const char* path, const input_range* r, long long* remaining) {
+    int fd = open(path, O_RDONLY);
+    *remaining = -1;
+    if ( fd >= 0 && r->part >= 0 ) {
+        off_t offset, length;
+        if ( partfile_range(fd, r->part, &offset, &length) < 0 ) {
+            fprintf(stderr, "chunky: %s has no partition %d\n", path, r->part);
+            exit(1);
+        }
+        lseek(fd, offset, SEEK_SET);
+        *remaining = length;
+        return fd;
+    }
+    if ( fd < 0 || r->length < 0 ) { return fd; }
+
+    off_t begin = r->offset == 0 ? 0 : line_end(fd, r->offset - 1);
+    off_t end = r->length == 0 ? begin : line_end(fd, r->offset + r->length - 1);
+    if ( end < begin ) { end = begin; }
+    lseek(fd, begin, SEEK_SET);
+    *remaining = end - begin;
+    return fd;
+}
+
+// Read up to len bytes, stopping short only at the end of input (or of the range)
+static int read_input(int fd, char* buf, int len, long long* remaining) {
+    if ( *remaining >= 0 && *remaining < len ) { len = *remaining; }
+    if ( len <= 0 ) { return 0; }
+    int rd = read(fd, buf, len);
+    if ( rd > 0 && *remaining >= 0 ) { *remaining -= rd; }
+    return rd;
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+    while ( len > 0 ) {
+        ssize_t wr = write(fd, buf, len);
+        if ( wr < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            return -1;
+        }
+        buf += wr;
+        len -= wr;
+    }
+    return 0;
+}
+
+// Output batching state, shared by everything that feeds stdout
+static int out;
+static char* buffer;
+static char* buffers[2];
+static int buffer_size = 0;
+static int min_avail = 1024*1024;
+static int offset = 0;
+static int avail = 0;
+
+static int double_buffer = 0;
+static int direct = 0;        // O_DIRECT is set on out, only whole DIRECT_ALIGN blocks go out until the end
+static int dontneed = 0;       // inputs, once read
+static int dontneed_out = 0;   // out, once written back, only when it's a file
+static off_t out_pos = 0;
+static off_t out_dropped = 0; // out is dropped from the page cache up to here
+static int compress_out = 0;
+static char* cmz_out;         // frames of the batch being written (--compress)
+static size_t cmz_out_size = 0;
+
+// Every buffered byte reaches out through here
+static void write_out(const char* data, int len) {
+    if ( compress_out ) {
+        len = cmz_encode(data, len, &cmz_out, &cmz_out_size);
+        data = cmz_out;
+    }
+    if ( write_all(out, data, len) < 0 ) {
+        fprintf(stderr, "chunky: write failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    xfer_bytes[XFER_BUFFERED] += len;
+
+    if ( dontneed_out && !direct ) {
+        // Start writeback of this batch, and drop the previous one which has had a batch worth of time to land
+        sync_file_range(out, out_pos, len, SYNC_FILE_RANGE_WRITE);
+        if ( out_pos > out_dropped ) {
+            sync_file_range(out, out_dropped, out_pos - out_dropped, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(out, out_dropped, out_pos - out_dropped, POSIX_FADV_DONTNEED);
+            out_dropped = out_pos;
+        }
+    }
+    out_pos += len;
+}
+
+// Double buffering: a writer thread drains one buffer while the other one fills
+static pthread_t writer;
+static pthread_mutex_t w_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t w_cond = PTHREAD_COND_INITIALIZER;
+static const char* w_data;
+static int w_len = 0;
+static int w_quit = 0;
+
+static void* writer_main(void* arg) {
+    pthread_mutex_lock(&w_lock);
+    while (1) {
+        while ( !w_len && !w_quit ) {
+            pthread_cond_wait(&w_cond, &w_lock);
+        }
+        if ( !w_len ) { break; }
+        pthread_mutex_unlock(&w_lock);
+        write_out(w_data, w_len);
+        pthread_mutex_lock(&w_lock);
+        w_len = 0;
+        pthread_cond_broadcast(&w_cond);
+    }
+    pthread_mutex_unlock(&w_lock);
+    return NULL;
+}
+
+static void writer_wait() {
+    pthread_mutex_lock(&w_lock);
+    while ( w_len ) {
+        pthread_cond_wait(&w_cond, &w_lock);
+    }
+    pthread_mutex_unlock(&w_lock);
+}
+
+static void flush_buffer() {
+    int tail = direct ? offset % DIRECT_ALIGN : 0;
+    int len = offset - tail;
+
+    if ( len > 0 ) {
+        if ( double_buffer ) {
+            writer_wait();
+            char* next = buffers[buffer == buffers[0]];
+            memcpy(next, &buffer[len], tail);
+            pthread_mutex_lock(&w_lock);
+            w_data = buffer;
+            w_len = len;
+            pthread_cond_broadcast(&w_cond);
+            pthread_mutex_unlock(&w_lock);
+            buffer = next;
+        } else {
+            write_out(buffer, len);
+            memmove(buffer, &buffer[len], tail);
+        }
+        offset = tail;
+    }
+    avail = buffer_size - offset;
+}
+
+// Write whatever is left, including any unaligned tail
+static void finish_output() {
+    if ( double_buffer ) {
+        writer_wait();
+        pthread_mutex_lock(&w_lock);
+        w_quit = 1;
+        pthread_cond_broadcast(&w_cond);
+        pthread_mutex_unlock(&w_lock);
+        pthread_join(writer, NULL);
+    }
+    if ( direct && offset > 0 ) {
+        fcntl(out, F_SETFL, fcntl(out, F_GETFL) & ~O_DIRECT);
+        direct = 0;
+    }
+    if ( offset > 0 ) {
+        write_out(buffer, offset);
+    }
+    offset = 0;
+    avail = buffer_size;
+
+    if ( dontneed_out && out_pos > out_dropped ) {
+        sync_file_range(out, out_dropped, 0, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(out, out_dropped, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+// Done with an input, keep it from crowding the page cache if asked to
+static void close_input(int fd) {
+    if ( dontneed ) { posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); }
+    close(fd);
+}
+
+// Copy already-read data into the batch, writing it out whenever it gets full
+static void buffer_append(const char* data, int len) {
+    while ( len > 0 ) {
+        int n = len < avail ? len : avail;
+        memcpy(&buffer[offset], data, n);
+        offset += n;
+        avail -= n;
+        data += n;
+        len -= n;
+        if ( avail < min_avail ) { flush_buffer(); }
+    }
+}
+
+// Intermediate files may be compressed (--compress, cmz.h) and may hold binary records (--binary, cmb.h),
+// both are undone on the way through so only text lines come out
+enum { INPUT_PLAIN = 0, INPUT_COMPRESSED, INPUT_BINARY };
+
+static void text_sink(void* arg, const char* data, size_t len) {
+    buffer_append(data, len);
+}
+
+// Only whole files and partitions are checked for the magic numbers the intermediate formats start with
+static int input_format(int fd, const input_range* r, long long remaining, const char* head, int head_len) {
+    char magic[4];
+    if ( r->length >= 0 && r->part < 0 ) { return INPUT_PLAIN; }
+    if ( head_len == 0 ) {
+        head = magic;
+        head_len = remaining >= 0 && remaining < sizeof(magic) ? remaining : sizeof(magic);
+        head_len = pread(fd, magic, head_len, lseek(fd, 0, SEEK_CUR));
+    }
+    if ( head_len < 4 ) { return INPUT_PLAIN; }
+    if ( cmz_is_compressed(head, head_len) ) { return INPUT_COMPRESSED; }
+    return cmb_is_binary(head, head_len) ? INPUT_BINARY : INPUT_PLAIN;
+}
+
+// Decode the rest of an input into the batch, head is what was already read of it
+static void decode_input(const char* path, int fd, int format, long long remaining, const char* head, int head_len) {
+    cmtext_decoder d;
+    cmtext_begin(&d, format == INPUT_COMPRESSED, text_sink, NULL);
+    cmtext_decode(&d, head, head_len);
+
+    char* raw = (char*)malloc(CMZ_BLOCK);
+    ssize_t rd;
+    while ( !d.error && ( rd = read_input(fd, raw, CMZ_BLOCK, &remaining) ) != 0 ) {
+        if ( rd < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            d.error = strerror(errno);
+            break;
+        }
+        cmtext_decode(&d, raw, rd);
+    }
+    free(raw);
+
+    if ( cmtext_end(&d) < 0 ) {
+        fprintf(stderr, "chunky: %s: %s\n", path, d.error);
+        exit(1);
+    }
+}
+
+// Read-ahead across glob inputs: a few threads open the next files and pull in their first
+// block while the current one is being written, the writer still takes them strictly in order
+typedef struct prefetch_slot_t {
+    int fd;
+    int ready;
+    char* head;
+    int head_len;
+    long long remaining; // left in the range after head
+} prefetch_slot;
+
+static char** pf_paths;
+static prefetch_slot* pf_slots;
+static int pf_num_paths = 0;
+static int pf_depth = 0;
+static int pf_next = 0;     // next path a reader will claim
+static int pf_consumed = 0; // paths handed over to the writer
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_cond = PTHREAD_COND_INITIALIZER;
+
+static void* prefetch_main(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&pf_lock);
+        while ( pf_next < pf_num_paths && pf_next >= pf_consumed + pf_depth ) {
+            pthread_cond_wait(&pf_cond, &pf_lock);
+        }
+        if ( pf_next >= pf_num_paths ) {
+            pthread_mutex_unlock(&pf_lock);
+            break;
+        }
+        int idx = pf_next++;
+        pthread_mutex_unlock(&pf_lock);
+
+        long long remaining = -1;
+        int fd = open_input( pf_paths[idx], &ranges[idx], &remaining );
+        char* head = NULL;
+        int head_len = 0;
+        if ( fd >= 0 ) {
+            posix_fadvise(fd, lseek(fd, 0, SEEK_CUR), remaining < 0 ? 0 : remaining, POSIX_FADV_WILLNEED);
+            head = (char*)malloc(PREFETCH_HEAD);
+            int rd = 0;
+            while ( head_len < PREFETCH_HEAD && ( rd = read_input(fd, &head[head_len], PREFETCH_HEAD - head_len, &remaining) ) > 0 ) {
+                head_len += rd;
+            }
+        }
+
+        pthread_mutex_lock(&pf_lock);
+        pf_slots[idx].fd = fd;
+        pf_slots[idx].head = head;
+        pf_slots[idx].head_len = head_len;
+        pf_slots[idx].remaining = remaining;
+        pf_slots[idx].ready = 1;
+        pthread_cond_broadcast(&pf_cond);
+        pthread_mutex_unlock(&pf_lock);
+    }
+    return NULL;
+}
+
+// Wait for the reader that owns idx, and let the next one start
+static prefetch_slot* prefetch_take(int idx) {
+    pthread_mutex_lock(&pf_lock);
+    while ( !pf_slots[idx].ready ) {
+        pthread_cond_wait(&pf_cond, &pf_lock);
+    }
+    pf_consumed = idx+1;
+    pthread_cond_broadcast(&pf_cond);
+    pthread_mutex_unlock(&pf_lock);
+    return &pf_slots[idx];
+}
+
+// Native gzip decoding (--gunzip)
+//
+// A pool of threads decodes the inputs ahead of the writer, which still emits them strictly in
+// glob order. Files made of many small gzip members are also split at member headers so one
+// large file can be decoded on several threads: each segment is decoded speculatively from a
+// verified header, and is only used if the previous segment finishes exactly where it starts.
+// If a header turns out to be a false match, the previous segment decodes straight through it.
+#define GZ_SEGMENT        (4*1024*1024)   // compressed bytes per segment of a multi-member file
+#define GZ_SCAN_WINDOW    (1024*1024)     // a second member must start this early for a file to be split
+#define GZ_SCAN_STEP      (64*1024)
+#define GZ_VERIFY_BYTES   (16*1024)
+#define GZ_IN_CHUNK       (256*1024)
+#define GZ_OUT_CHUNK      (1024*1024)
+#define GZ_UNIT_QUEUE_MAX (16*1024*1024)  // decoded bytes a segment may hold ahead of the writer
+
+enum { GZ_PENDING = 0, GZ_RUNNING, GZ_DONE, GZ_FAILED };
+enum { GZ_UNPLANNED = 0, GZ_PLANNING, GZ_PLANNED };
+
+typedef struct gz_chunk_t {
+    struct gz_chunk_t* next;
+    int len;
+    char data[];
+} gz_chunk;
+
+typedef struct gz_unit_t {
+    off_t start;
+    int state;
+    int absorbed;
+    const char* error;
+    gz_chunk* head;
+    gz_chunk* tail;
+    size_t queued;
+} gz_unit;
+
+typedef struct gz_file_t {
+    int state;
+    int fd;
+    off_t size;
+    int num_units;
+    gz_unit* units;
+} gz_file;
+
+static char** gz_paths;
+static gz_file* gz_files;
+static int gz_num_files = 0;
+static int gz_lookahead = 0;
+static int gz_w_file = 0;  // writer position, the unit being written never waits on the queue cap
+static int gz_w_unit = 0;
+static pthread_mutex_t gz_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gz_cond = PTHREAD_COND_INITIALIZER;
+
+static int gz_is_member(const unsigned char* buf) {
+    return buf[0] == 0x1f && buf[1] == 0x8b && buf[2] == 8 && ( buf[3] & 0xe0 ) == 0;
+}
+
+// Does a member really start here? Inflate a little of it and see if zlib complains
+static int gz_verify(const unsigned char* buf, size_t len) {
+    if ( len < 18 || !gz_is_member(buf) ) { return 0; }
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if ( inflateInit2(&z, 15+16) != Z_OK ) { return 0; }
+
+    unsigned char scratch[16384];
+    size_t produced = 0;
+    int rc;
+    z.next_in = (unsigned char*)buf;
+    z.avail_in = len;
+    do {
+        z.next_out = scratch;
+        z.avail_out = sizeof(scratch);
+        rc = inflate(&z, Z_NO_FLUSH);
+        produced += sizeof(scratch) - z.avail_out;
+    } while ( rc == Z_OK && z.avail_in > 0 && produced < 4*sizeof(scratch) );
+    inflateEnd(&z);
+
+    return rc == Z_OK || rc == Z_STREAM_END || rc == Z_BUF_ERROR;
+}
+
+// First verified member header in [from, to), or -1
+static off_t gz_find_member(int fd, off_t from, off_t to) {
+    unsigned char* buf = (unsigned char*)malloc(GZ_SCAN_STEP + GZ_VERIFY_BYTES);
+    off_t found = -1;
+
+    for ( off_t pos = from; pos < to && found < 0; pos += GZ_SCAN_STEP ) {
+        ssize_t rd = pread(fd, buf, GZ_SCAN_STEP + GZ_VERIFY_BYTES, pos);
+        if ( rd <= 0 ) { break; }
+
+        int scan = rd < GZ_SCAN_STEP ? rd : GZ_SCAN_STEP;
+        if ( pos + scan > to ) { scan = to - pos; }
+        for ( unsigned char* p = buf; ( p = memchr(p, 0x1f, scan - (p - buf)) ) != NULL; p++ ) {
+            if ( gz_verify(p, rd - (p - buf)) ) {
+                found = pos + (p - buf);
+                break;
+            }
+        }
+    }
+
+    free(buf);
+    return found;
+}
+
+static void gz_plan(gz_file* gf, const char* path) {
+    gf->fd = open( path, O_RDONLY );
+    gf->num_units = 0;
+
+    struct stat st;
+    if ( gf->fd >= 0 && fstat(gf->fd, &st) == 0 && st.st_size > 0 ) {
+        gf->size = st.st_size;
+        posix_fadvise(gf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        int max_units = gf->size / GZ_SEGMENT + 1;
+        gf->units = (gz_unit*)calloc(max_units, sizeof(gz_unit));
+        gf->units[gf->num_units++].start = 0;
+
+        // Only worth looking for split points if members are small
+        if ( gf->size > 2*GZ_SEGMENT && gz_find_member(gf->fd, 1, GZ_SCAN_WINDOW) > 0 ) {
+            for ( off_t split = GZ_SEGMENT; split + GZ_SEGMENT/2 < gf->size; split += GZ_SEGMENT ) {
+                off_t start = gz_find_member(gf->fd, split, split + GZ_SEGMENT);
+                if ( start > gf->units[gf->num_units-1].start ) {
+                    gf->units[gf->num_units++].start = start;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_lock(&gz_lock);
+    gf->state = GZ_PLANNED;
+    pthread_cond_broadcast(&gz_cond);
+    pthread_mutex_unlock(&gz_lock);
+}
+
+// Hand a decoded chunk to the writer, returns -1 if this segment was absorbed by its predecessor
+static int gz_push(int f, int k, gz_chunk* c) {
+    gz_unit* u = &gz_files[f].units[k];
+
+    pthread_mutex_lock(&gz_lock);
+    while ( u->queued >= GZ_UNIT_QUEUE_MAX && !u->absorbed && !( f == gz_w_file && k == gz_w_unit ) ) {
+        pthread_cond_wait(&gz_cond, &gz_lock);
+    }
+    if ( u->absorbed ) {
+        pthread_mutex_unlock(&gz_lock);
+        free(c);
+        return -1;
+    }
+    c->next = NULL;
+    if ( u->tail ) { u->tail->next = c; } else { u->head = c; }
+    u->tail = c;
+    u->queued += c->len;
+    pthread_cond_broadcast(&gz_cond);
+    pthread_mutex_unlock(&gz_lock);
+    return 0;
+}
+
+static void gz_finish(gz_unit* u, int state, const char* error) {
+    pthread_mutex_lock(&gz_lock);
+    u->state = state;
+    u->error = error;
+    pthread_cond_broadcast(&gz_cond);
+    pthread_mutex_unlock(&gz_lock);
+}
+
+static void gz_decode(int f, int k) {
+    gz_file* gf = &gz_files[f];
+    gz_unit* u = &gf->units[k];
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    inflateInit2(&z, 15+16);
+
+    unsigned char* in = (unsigned char*)malloc(GZ_IN_CHUNK);
+    gz_chunk* c = (gz_chunk*)malloc(sizeof(gz_chunk) + GZ_OUT_CHUNK);
+    c->len = 0;
+    off_t pos = u->start;
+    int eof = 0;
+    int state = GZ_DONE;
+    const char* error = NULL;
+    z.next_in = in;
+
+    while (1) {
+        if ( z.avail_in < 2 && !eof ) {
+            // Keep at least two bytes around so a member boundary can be checked for a header
+            memmove(in, z.next_in, z.avail_in);
+            ssize_t rd = pread(gf->fd, in + z.avail_in, GZ_IN_CHUNK - z.avail_in, pos);
+            if ( rd < 0 && errno == EINTR ) { continue; }
+            if ( rd < 0 ) { state = GZ_FAILED; error = "read error"; break; }
+            if ( rd == 0 ) { eof = 1; }
+            pos += rd;
+            z.next_in = in;
+            z.avail_in += rd;
+        }
+        if ( z.avail_in == 0 && eof ) { state = GZ_FAILED; error = "unexpected end of file"; break; }
+
+        z.next_out = (unsigned char*)&c->data[c->len];
+        z.avail_out = GZ_OUT_CHUNK - c->len;
+        int rc = inflate(&z, Z_NO_FLUSH);
+        c->len = GZ_OUT_CHUNK - z.avail_out;
+
+        if ( rc == Z_BUF_ERROR && eof && z.avail_out > 0 ) { state = GZ_FAILED; error = "unexpected end of file"; break; }
+
+        if ( c->len == GZ_OUT_CHUNK ) {
+            if ( gz_push(f, k, c) < 0 ) { c = NULL; break; }
+            c = (gz_chunk*)malloc(sizeof(gz_chunk) + GZ_OUT_CHUNK);
+            c->len = 0;
+        }
+
+        if ( rc == Z_STREAM_END ) {
+            off_t member_end = pos - z.avail_in;
+
+            // Claim any following segment this member ran past, its header was a false match
+            pthread_mutex_lock(&gz_lock);
+            int next = k+1;
+            while ( next < gf->num_units && ( gf->units[next].absorbed || member_end > gf->units[next].start ) ) {
+                gf->units[next].absorbed = 1;
+                next++;
+            }
+            int mine = u->absorbed;
+            pthread_cond_broadcast(&gz_cond);
+            pthread_mutex_unlock(&gz_lock);
+
+            if ( mine ) { break; }
+            off_t boundary = next < gf->num_units ? gf->units[next].start : gf->size;
+            if ( member_end >= boundary ) { break; }
+
+            if ( z.avail_in < 2 ) {
+                memmove(in, z.next_in, z.avail_in);
+                ssize_t rd = pread(gf->fd, in + z.avail_in, GZ_IN_CHUNK - z.avail_in, pos);
+                if ( rd > 0 ) { pos += rd; z.avail_in += rd; }
+                z.next_in = in;
+            }
+            if ( z.avail_in < 2 || !gz_is_member(z.next_in) ) {
+                if ( z.avail_in > 0 && z.next_in[0] != 0 ) { fprintf(stderr, "chunky: %s: trailing garbage ignored\n", gz_paths[f]); }
+                break;
+            }
+            inflateReset(&z);
+        }
+        else if ( rc != Z_OK && rc != Z_BUF_ERROR ) {
+            state = GZ_FAILED;
+            error = "invalid compressed data";
+            break;
+        }
+    }
+
+    if ( c && c->len > 0 && state == GZ_DONE ) {
+        gz_push(f, k, c);
+    } else {
+        free(c);
+    }
+    inflateEnd(&z);
+    free(in);
+    gz_finish(u, state, error);
+}
+
+static void* gz_main(void* arg) {
+    pthread_mutex_lock(&gz_lock);
+    while (1) {
+        int claimed = 0;
+        int exhausted = 1;
+        int ahead = 0;
+
+        for ( int f = gz_w_file; f < gz_num_files && !claimed; f++ ) {
+            gz_file* gf = &gz_files[f];
+            if ( ahead >= gz_lookahead ) { exhausted = 0; break; }
+
+            if ( gf->state == GZ_UNPLANNED ) {
+                gf->state = GZ_PLANNING;
+                pthread_mutex_unlock(&gz_lock);
+                gz_plan(gf, gz_paths[f]);
+                pthread_mutex_lock(&gz_lock);
+                claimed = 1;
+                break;
+            }
+            if ( gf->state == GZ_PLANNING ) {
+                exhausted = 0;
+                ahead++;
+                continue;
+            }
+
+            for ( int k = ( f == gz_w_file ? gz_w_unit : 0 ); k < gf->num_units; k++ ) {
+                if ( ahead >= gz_lookahead ) { exhausted = 0; break; }
+                gz_unit* u = &gf->units[k];
+                if ( u->state == GZ_PENDING && !u->absorbed ) {
+                    u->state = GZ_RUNNING;
+                    pthread_mutex_unlock(&gz_lock);
+                    gz_decode(f, k);
+                    pthread_mutex_lock(&gz_lock);
+                    claimed = 1;
+                    break;
+                }
+                ahead++;
+            }
+        }
+
+        if ( claimed ) { continue; }
+        if ( exhausted ) { break; }
+        pthread_cond_wait(&gz_cond, &gz_lock);
+    }
+    pthread_mutex_unlock(&gz_lock);
+    return NULL;
+}
+
+static void gunzip_inputs(char** paths, int num_paths, int threads) {
+    gz_paths = paths;
+    gz_num_files = num_paths;
+    gz_lookahead = threads * 2;
+    gz_files = (gz_file*)calloc(num_paths+1, sizeof(gz_file));
+
+    pthread_t* decoders = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    for ( int i=0; i<threads; i++ ) {
+        pthread_create(&decoders[i], NULL, gz_main, NULL);
+    }
+
+    pthread_mutex_lock(&gz_lock);
+    for ( int f=0; f<num_paths; f++ ) {
+        gz_file* gf = &gz_files[f];
+        while ( gf->state != GZ_PLANNED ) {
+            pthread_cond_wait(&gz_cond, &gz_lock);
+        }
+
+        for ( int k=0; k<gf->num_units; k++ ) {
+            gz_unit* u = &gf->units[k];
+            gz_w_file = f;
+            gz_w_unit = k;
+            pthread_cond_broadcast(&gz_cond);
+
+            // Everything before this segment is written, so whether it was absorbed is settled
+            while ( u->absorbed ? u->state == GZ_RUNNING : ( u->head || u->state < GZ_DONE ) ) {
+                if ( !u->absorbed && u->head ) {
+                    gz_chunk* c = u->head;
+                    u->head = c->next;
+                    if ( !u->head ) { u->tail = NULL; }
+                    u->queued -= c->len;
+                    pthread_cond_broadcast(&gz_cond);
+                    pthread_mutex_unlock(&gz_lock);
+                    buffer_append(c->data, c->len);
+                    free(c);
+                    pthread_mutex_lock(&gz_lock);
+                    continue;
+                }
+                pthread_cond_wait(&gz_cond, &gz_lock);
+            }
+
+            if ( !u->absorbed && u->state == GZ_FAILED ) {
+                fprintf(stderr, "chunky: %s: %s\n", paths[f], u->error);
+                exit(1);
+            }
+            while ( u->head ) {
+                gz_chunk* c = u->head;
+                u->head = c->next;
+                free(c);
+            }
+        }
+
+        gz_w_file = f+1;
+        gz_w_unit = 0;
+        pthread_cond_broadcast(&gz_cond);
+        if ( gf->fd >= 0 ) { close_input(gf->fd); }
+        free(gf->units);
+    }
+    pthread_mutex_unlock(&gz_lock);
+
+    for ( int i=0; i<threads; i++ ) {
+        pthread_join(decoders[i], NULL);
+    }
+    free(decoders);
+}
+
+static void report() {
+    for ( int i=0; i<XFER_METHODS; i++ ) {
+        if ( xfer_bytes[i] > 0 ) {
+            fprintf(stderr, "chunky: %s %lld bytes\n", xfer_names[i], xfer_bytes[i]);
+        }
+    }
+}
+
 int main(int argc, char* const argv[]) {
     int argi=1;
     int option_index = 0;
-    int buffer_size = 0;
-    int min_avail = 1024*1024;
     int fd = fileno(stdin);
+    int zero_copy = 0;
+    int verbose = 0;
+    int prefetch = 0;
+    int gunzip = 0;
+    int threads = 4;
+    out = fileno(stdout);
 
     while (1) {
         int opt = getopt_long(argc, argv, short_options, long_options, &option_index);
@@ -48,28 +864,124 @@ int main(int argc, char* const argv[]) {
                 argi+=2;
                 buffer_size = atoi(optarg);
                 break;
+            case 'z': // zero-copy
+                argi++;
+                zero_copy = 1;
+                break;
+            case 'v': // verbose
+                argi++;
+                verbose = 1;
+                break;
+            case 'p': // prefetch
+                argi+=2;
+                prefetch = atoi(optarg);
+                break;
+            case 'g': // gunzip
+                argi++;
+                gunzip = 1;
+                break;
+            case 't': // threads
+                argi+=2;
+                threads = atoi(optarg);
+                break;
+            case 'd': // double-buffer
+                argi++;
+                double_buffer = 1;
+                break;
+            case 'D': // direct
+                argi++;
+                direct = 1;
+                break;
+            case 'n': // dontneed
+                argi++;
+                dontneed = 1;
+                break;
+            case 'c': // compress
+                argi++;
+                compress_out = 1;
+                break;
         }
     }
 
-    if (buffer_size <= 0) { fprintf(stderr, "Usage: buffer -s <size in Mb>\n"); return -1; }
+    if (buffer_size <= 0 || threads <= 0) {
+        fprintf(stderr, "Usage: buffer -s <size in Mb> [--zero-copy] [--prefetch <files>] [--gunzip [--threads <n>]] [--double-buffer] [--direct] [--dontneed] [--compress] [--verbose] [path[:offset:length|#partition] ...]\n");
+        return -1;
+    }
     buffer_size = buffer_size * 1024 * 1024;
+    if ( prefetch > MAX_PREFETCH ) { prefetch = MAX_PREFETCH; }
+    if ( gunzip ) { prefetch = 0; } // the decoders read ahead on their own
+
+    if ( gunzip && argi >= argc ) { fprintf(stderr, "chunky: --gunzip needs file inputs\n"); return -1; }
+
+    // Overlapped, direct and compressed writes need the buffers to themselves, frames don't come out aligned
+    if ( compress_out ) { direct = 0; }
+    if ( double_buffer || direct || compress_out ) { zero_copy = 0; }
+
+    // Inputs are dropped whatever out is, writeback and dropping out only make sense for a file
+    struct stat out_st;
+    dontneed_out = dontneed;
+    if ( fstat(out, &out_st) != 0 || !S_ISREG(out_st.st_mode) ) {
+        direct = 0;
+        dontneed_out = 0;
+    }
+    // Aligned writes only land aligned from an aligned offset, appending (or an unaligned start) gets plain writes
+    int out_flags = fcntl(out, F_GETFL);
+    if ( dontneed_out || direct ) {
+        out_pos = out_flags & O_APPEND ? out_st.st_size : lseek(out, 0, SEEK_CUR);
+        out_dropped = out_pos;
+    }
+    if ( direct && ( out_flags & O_APPEND || out_pos < 0 || out_pos % DIRECT_ALIGN != 0 ) ) {
+        direct = 0;
+    }
+    if ( direct && fcntl(out, F_SETFL, out_flags | O_DIRECT) < 0 ) {
+        direct = 0; // Not supported here, plain writes it is
+    }
+
+    for ( int i=0; i<(double_buffer ? 2 : 1); i++ ) {
+        if ( posix_memalign((void**)&buffers[i], DIRECT_ALIGN, buffer_size) != 0 ) {
+            fprintf(stderr, "chunky: failed to allocate buffer\n");
+            exit(1);
+        }
+    }
+    buffer = buffers[0];
+    avail = buffer_size;
 
-    char *buffer = (char*)malloc(buffer_size);
+    if ( double_buffer ) {
+        pthread_create(&writer, NULL, writer_main, NULL);
+    }
 
     if ( argi >= argc ) { // STDIN
+        int method = zero_copy ? pick_xfer(fd, out) : XFER_BUFFERED;
+        if ( method != XFER_BUFFERED ) {
+            int rc = kernel_xfer(method, fd, out, buffer_size, -1);
+            if ( rc == -2 ) { exit(1); }
+            if ( rc == 0 ) {
+                close(fd);
+                close(out);
+                if ( verbose ) { report(); }
+                exit(0);
+            }
+            // Nothing moved yet, fall through to the buffered loop
+        }
+
         while (1) {
             int total_rd = 0;
             int rd = 0;
             do {
-                rd = read(fd, &buffer[total_rd], buffer_size-total_rd);
-                total_rd += rd;
-            } while( rd > 0 && (buffer_size - total_rd) > 0 );
+                rd = read(fd, &buffer[offset], avail);
+                if ( rd > 0 ) {
+                    total_rd += rd;
+                    offset += rd;
+                    avail -= rd;
+                }
+            } while( rd > 0 && avail > 0 );
             if ( total_rd == 0 ) { break; } // Didn't read anything, were done
-            write(fileno(stdout), buffer, total_rd);
+            flush_buffer();
         }
+        finish_output();
         close(fd);
-        close(fileno(stdout));
-        free(buffer);
+        close(out);
+        if ( verbose ) { report(); }
         exit(0);
     }
 
@@ -83,51 +995,107 @@ int main(int argc, char* const argv[]) {
     my_glob.gl_readdir = (struct dirent* (*)(void*))readdir;
     my_glob.gl_closedir = (void (*)(void*))closedir;
     int idx_glob = 0;
-    int idx_glob_end = -1;
-    int offset = 0;
-    int avail = buffer_size;
 
+    // Expand everything up front so the read-ahead can see past the current pattern
+    int num_ranges = 0;
     while ( argi < argc ) {
-        glob(argv[argi], glob_flags, NULL, &my_glob);
+        input_range r;
+        char* pattern = parse_range(argv[argi], &r);
+        if ( gunzip && ( r.length >= 0 || r.part >= 0 ) ) { fprintf(stderr, "chunky: --gunzip can't read byte ranges\n"); exit(1); }
+        glob(pattern, glob_flags, NULL, &my_glob);
+        ranges = (input_range*)realloc(ranges, (my_glob.gl_pathc+1) * sizeof(input_range));
+        for ( ; num_ranges < my_glob.gl_pathc; num_ranges++ ) {
+            ranges[num_ranges] = r; // every match of a pattern gets its range
+        }
         glob_flags = GLOB_ALTDIRFUNC|GLOB_BRACE|GLOB_APPEND;
-        idx_glob_end = my_glob.gl_pathc;
         argi++;
+    }
+
+    if ( gunzip ) {
+        gunzip_inputs(my_glob.gl_pathv, my_glob.gl_pathc, threads);
+        idx_glob = my_glob.gl_pathc;
+    }
+
+    pthread_t readers[MAX_PREFETCH];
+    if ( prefetch > 0 ) {
+        pf_paths = my_glob.gl_pathv;
+        pf_num_paths = my_glob.gl_pathc;
+        pf_depth = prefetch;
+        pf_slots = (prefetch_slot*)calloc(pf_num_paths+1, sizeof(prefetch_slot));
+        for ( int i=0; i<prefetch; i++ ) {
+            pthread_create(&readers[i], NULL, prefetch_main, NULL);
+        }
+    }
+
+    while ( idx_glob < my_glob.gl_pathc ) {
+        long long remaining = -1;
+        char* head = NULL;
+        int head_len = 0;
+        if ( prefetch > 0 ) {
+            prefetch_slot* slot = prefetch_take(idx_glob);
+            fd = slot->fd;
+            remaining = slot->remaining;
+            head = slot->head;
+            head_len = slot->head_len;
+            slot->head = NULL;
+        } else {
+            fd = open_input( my_glob.gl_pathv[idx_glob], &ranges[idx_glob], &remaining );
+        }
+        idx_glob++;
+        if ( fd < 0 ) {
+            free(head);
+            continue;
+        }
+
+        int format = input_format(fd, &ranges[idx_glob-1], remaining, head, head_len);
+        if ( format != INPUT_PLAIN ) {
+            decode_input(my_glob.gl_pathv[idx_glob-1], fd, format, remaining, head, head_len);
+            free(head);
+            close_input(fd);
+            continue;
+        }
+        if ( head_len > 0 ) {
+            buffer_append(head, head_len);
+        }
+        free(head);
 
-        while ( idx_glob < idx_glob_end ) {
-            fd = open( my_glob.gl_pathv[idx_glob], O_RDONLY );
-            idx_glob++;
-            if ( fd < 0 ) { continue; }
+        int method = zero_copy ? pick_xfer(fd, out) : XFER_BUFFERED;
+        if ( method != XFER_BUFFERED ) {
+            // Anything already buffered has to go out first to keep the output in order
+            flush_buffer();
+            int rc = kernel_xfer(method, fd, out, buffer_size, remaining);
+            if ( rc == -2 ) { exit(1); }
+            if ( rc == 0 ) {
+                close_input(fd);
+                continue;
+            }
+        }
 
-            while (1) {
-                int total_rd = 0;
-                int rd = 0;
-                do {
-                    rd = read(fd, &buffer[total_rd+offset], avail);
+        while (1) {
+            int total_rd = 0;
+            int rd = 0;
+            do {
+                rd = read_input(fd, &buffer[offset], avail, &remaining);
+                if ( rd > 0 ) {
                     total_rd += rd;
+                    offset += rd;
                     avail -= rd;
-                } while( rd > 0 && avail > 0 );
-                if ( total_rd <= 0 ) { break; } // Didn't read anything, were done
-/*
-                write(fileno(stdout), buffer, total_rd);
-                avail = buffer_size;
-*/
-                if ( avail < min_avail ) {
-                    write(fileno(stdout), buffer, total_rd+offset);
-                    avail = buffer_size;
-                    offset = 0;
-                } else {
-                    offset += total_rd;
                 }
+            } while( rd > 0 && avail > 0 );
+            if ( total_rd <= 0 ) { break; } // Didn't read anything, were done
 
+            if ( avail < min_avail ) {
+                flush_buffer();
             }
-            close(fd);
         }
+        close_input(fd);
     }
 
-    if ( offset > 0 ) {
-        write(fileno(stdout), buffer, offset);
+    for ( int i=0; i<prefetch; i++ ) {
+        pthread_join(readers[i], NULL);
     }
 
-    close(fileno(stdout));
-    free(buffer);
+    finish_output();
+    close(out);
+    if ( verbose ) { report(); }
 }
@@ -0,0 +1,313 @@
+/*  Copyright (C) 2014 Chitika Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Length prefixed records for sorted intermediate files (--binary)
+//
+// A file is one or more segments:
+//
+//     segment: "\x89CMB" | block ... | le32 0 | le32 index length | index | trailer
+//     block:   le32 length | record ...
+//     record:  varint key length | varint rest length | key | rest
+//     index:   per block, le64 offset of the block in the segment | varint first key length | first key
+//     trailer: le64 index offset | le32 index length | "CMBX"
+//
+// A record is a text line without its newline, cut at the delimiter: the rest starts with the delimiter and is
+// empty if the line has none, so key and rest sit next to each other. Readers get keys without looking for the
+// delimiter, and can binary search the block index of a sorted file. Segments concatenate, streaming readers skip
+// each one's index and the trailers chain back from the end of the file to every segment's index.
+
+#include <stdint.h>
+
+#define CMB_MAGIC "\x89" "CMB"
+#define CMB_TRAILER_MAGIC "CMBX"
+#define CMB_TRAILER 16
+#define CMB_BLOCK (64*1024)
+
+static inline int cmb_is_binary(const char* data, size_t len) {
+    return len >= 4 && memcmp(data, CMB_MAGIC, 4) == 0;
+}
+
+static inline uint32_t cmb_get32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t cmb_get64(const unsigned char* p) {
+    return cmb_get32(p) | (uint64_t)cmb_get32(&p[4]) << 32;
+}
+
+static inline void cmb_put32(unsigned char* p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline void cmb_put64(unsigned char* p, uint64_t v) {
+    cmb_put32(p, v);
+    cmb_put32(&p[4], v >> 32);
+}
+
+// Bytes used by the varint at p, 0 if it's cut off, -1 if it's too long to be a length
+static inline int cmb_get_varint(const unsigned char* p, size_t len, uint32_t* v) {
+    *v = 0;
+    for ( int i=0; i<5; i++ ) {
+        if ( i >= len ) { return 0; }
+        *v |= (uint32_t)(p[i] & 0x7f) << (7*i);
+        if ( !( p[i] & 0x80 ) ) { return i+1; }
+    }
+    return -1;
+}
+
+static inline int cmb_put_varint(unsigned char* p, uint32_t v) {
+    int n = 0;
+    while ( v >= 0x80 ) {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+
+// Writing, whole blocks and the closing index go to a sink
+typedef void (*cmb_sink)(void* arg, const char* data, size_t len);
+
+typedef struct cmb_writer_t {
+    cmb_sink sink;
+    void* arg;
+    uint64_t pos;  // bytes of the segment handed to the sink
+    unsigned char* block;
+    size_t block_len;
+    size_t block_size;
+    unsigned char* index;
+    size_t index_len;
+    size_t index_size;
+} cmb_writer;
+
+static inline void cmb_begin(cmb_writer* w, cmb_sink sink, void* arg) {
+    memset(w, 0, sizeof(cmb_writer));
+    w->sink = sink;
+    w->arg = arg;
+    w->block_size = CMB_BLOCK + 1024;
+    w->block = (unsigned char*)malloc(w->block_size);
+    w->block_len = 4; // length goes in front once it's known
+    w->index_size = 4096;
+    w->index = (unsigned char*)malloc(w->index_size);
+    w->sink(w->arg, CMB_MAGIC, 4);
+    w->pos = 4;
+}
+
+static inline void cmb_flush_block(cmb_writer* w) {
+    if ( w->block_len == 4 ) { return; }
+    cmb_put32(w->block, w->block_len - 4);
+    w->sink(w->arg, (const char*)w->block, w->block_len);
+    w->pos += w->block_len;
+    w->block_len = 4;
+}
+
+static inline void cmb_add(cmb_writer* w, const char* key, uint32_t key_len, const char* rest, uint32_t rest_len) {
+    if ( w->block_len == 4 ) {
+        // First record of a block, index it
+        if ( w->index_len + 13 + key_len > w->index_size ) {
+            while ( w->index_len + 13 + key_len > w->index_size ) { w->index_size *= 2; }
+            w->index = (unsigned char*)realloc(w->index, w->index_size);
+        }
+        cmb_put64(&w->index[w->index_len], w->pos);
+        w->index_len += 8;
+        w->index_len += cmb_put_varint(&w->index[w->index_len], key_len);
+        memcpy(&w->index[w->index_len], key, key_len);
+        w->index_len += key_len;
+    }
+
+    size_t need = w->block_len + 10 + key_len + rest_len;
+    if ( need > w->block_size ) { // a record bigger than a block gets one to itself
+        w->block_size = need;
+        w->block = (unsigned char*)realloc(w->block, w->block_size);
+    }
+    w->block_len += cmb_put_varint(&w->block[w->block_len], key_len);
+    w->block_len += cmb_put_varint(&w->block[w->block_len], rest_len);
+    memcpy(&w->block[w->block_len], key, key_len);
+    w->block_len += key_len;
+    memcpy(&w->block[w->block_len], rest, rest_len);
+    w->block_len += rest_len;
+
+    if ( w->block_len >= CMB_BLOCK ) { cmb_flush_block(w); }
+}
+
+// Close the segment with its index
+static inline void cmb_end(cmb_writer* w) {
+    cmb_flush_block(w);
+
+    unsigned char end[8];
+    cmb_put32(end, 0);
+    cmb_put32(&end[4], w->index_len);
+    w->sink(w->arg, (const char*)end, sizeof(end));
+    w->pos += sizeof(end);
+
+    unsigned char trailer[CMB_TRAILER];
+    cmb_put64(trailer, w->pos);
+    cmb_put32(&trailer[8], w->index_len);
+    memcpy(&trailer[12], CMB_TRAILER_MAGIC, 4);
+    w->sink(w->arg, (const char*)w->index, w->index_len);
+    w->sink(w->arg, (const char*)trailer, sizeof(trailer));
+
+    free(w->block);
+    free(w->index);
+    memset(w, 0, sizeof(cmb_writer));
+}
+
+
+// Reading, records one at a time out of whatever part of the file is at hand
+enum { CMB_ERROR = -1, CMB_MORE = 0, CMB_RECORD = 1 };
+enum { CMB_START = 0, CMB_BLOCK_HEAD, CMB_IN_BLOCK, CMB_SKIP };
+
+typedef struct cmb_reader_t {
+    int state;
+    uint64_t left; // bytes left in the block, or to skip
+} cmb_reader;
+
+typedef struct cmb_record_t {
+    const char* key; // the rest follows it
+    uint32_t key_len;
+    uint32_t rest_len;
+} cmb_record;
+
+// Next record in data, *used is set to the bytes consumed (framing included, even if more data is needed)
+static inline int cmb_next(cmb_reader* r, const char* data, size_t len, size_t* used, cmb_record* rec) {
+    size_t pos = 0;
+    int rc = CMB_MORE;
+    while ( rc == CMB_MORE ) {
+        const unsigned char* p = (const unsigned char*)&data[pos];
+        size_t n = len - pos;
+
+        if ( r->state == CMB_START ) {
+            if ( n < 4 ) { break; }
+            if ( !cmb_is_binary((const char*)p, n) ) { rc = CMB_ERROR; break; }
+            pos += 4;
+            r->state = CMB_BLOCK_HEAD;
+        } else if ( r->state == CMB_BLOCK_HEAD ) {
+            if ( n < 4 ) { break; }
+            r->left = cmb_get32(p);
+            if ( r->left > 0 ) {
+                pos += 4;
+                r->state = CMB_IN_BLOCK;
+                continue;
+            }
+            // End of the segment, skip its index
+            if ( n < 8 ) { break; }
+            r->left = cmb_get32(&p[4]) + CMB_TRAILER;
+            pos += 8;
+            r->state = CMB_SKIP;
+        } else if ( r->state == CMB_SKIP ) {
+            size_t skip = n < r->left ? n : r->left;
+            pos += skip;
+            r->left -= skip;
+            if ( r->left > 0 ) { break; }
+            r->state = CMB_START;
+        } else if ( r->left == 0 ) {
+            r->state = CMB_BLOCK_HEAD;
+        } else {
+            uint32_t key_len, rest_len;
+            int a = cmb_get_varint(p, n, &key_len);
+            int b = a > 0 ? cmb_get_varint(&p[a], n - a, &rest_len) : a;
+            if ( a < 0 || b < 0 ) { rc = CMB_ERROR; break; }
+            if ( a == 0 || b == 0 ) { break; }
+
+            uint64_t need = (uint64_t)a + b + key_len + rest_len;
+            if ( need > r->left ) { rc = CMB_ERROR; break; }
+            if ( need > n ) { break; }
+            rec->key = (const char*)&p[a+b];
+            rec->key_len = key_len;
+            rec->rest_len = rest_len;
+            pos += need;
+            r->left -= need;
+            rc = CMB_RECORD;
+        }
+    }
+    *used = pos;
+    return rc;
+}
+
+// Did the data end between segments?
+static inline int cmb_at_end(const cmb_reader* r) {
+    return r->state == CMB_START;
+}
+
+
+// The block index of every segment of a mapped file, in file order
+typedef struct cmb_block_t {
+    uint64_t offset; // of the block in the file
+    uint64_t end;
+    const char* key;
+    uint32_t key_len;
+} cmb_block;
+
+// Returns the number of blocks, or -1 if the file isn't a clean run of segments
+static inline int cmb_load_index(const char* map, size_t len, cmb_block** blocks) {
+    const unsigned char* m = (const unsigned char*)map;
+    size_t* starts = NULL;
+    size_t* index_ends = NULL;
+    int num_segments = 0;
+
+    // Walk the trailers back from the end
+    for ( size_t end = len; end > 0; ) {
+        if ( end < 4 + 8 + CMB_TRAILER || memcmp(&m[end-4], CMB_TRAILER_MAGIC, 4) != 0 ) { num_segments = -1; break; }
+        uint64_t index_offset = cmb_get64(&m[end-CMB_TRAILER]);
+        uint64_t index_len = cmb_get32(&m[end-CMB_TRAILER+8]);
+        uint64_t seg_len = index_offset + index_len + CMB_TRAILER;
+        if ( seg_len > end || index_offset < 4 + 8 || !cmb_is_binary(&map[end-seg_len], 4) ) { num_segments = -1; break; }
+
+        starts = (size_t*)realloc(starts, (num_segments+1) * sizeof(size_t));
+        index_ends = (size_t*)realloc(index_ends, (num_segments+1) * sizeof(size_t));
+        starts[num_segments] = end - seg_len;
+        index_ends[num_segments] = end - CMB_TRAILER;
+        num_segments++;
+        end -= seg_len;
+    }
+
+    int num_blocks = 0;
+    int max_blocks = 0;
+    *blocks = NULL;
+    for ( int s = num_segments-1; s >= 0; s-- ) {
+        size_t pos = index_ends[s] - cmb_get32(&m[index_ends[s]+8]);
+        while ( pos < index_ends[s] ) {
+            uint32_t key_len;
+            int n = index_ends[s] - pos >= 8 ? cmb_get_varint(&m[pos+8], index_ends[s] - pos - 8, &key_len) : 0;
+            if ( n <= 0 || pos + 8 + n + key_len > index_ends[s] ) { num_segments = -1; break; }
+
+            uint64_t offset = starts[s] + cmb_get64(&m[pos]);
+            if ( offset + 4 > index_ends[s] ) { num_segments = -1; break; }
+            if ( num_blocks == max_blocks ) {
+                max_blocks = max_blocks ? max_blocks * 2 : 64;
+                *blocks = (cmb_block*)realloc(*blocks, max_blocks * sizeof(cmb_block));
+            }
+            cmb_block* b = &(*blocks)[num_blocks++];
+            b->offset = offset;
+            b->end = offset + 4 + cmb_get32(&m[offset]);
+            if ( b->end > index_ends[s] ) { num_segments = -1; break; }
+            b->key = &map[pos + 8 + n];
+            b->key_len = key_len;
+            pos += 8 + n + key_len;
+        }
+        if ( num_segments < 0 ) { break; }
+    }
+
+    free(starts);
+    free(index_ends);
+    if ( num_segments < 0 ) {
+        free(*blocks);
+        *blocks = NULL;
+        return -1;
+    }
+    return num_blocks;
+}
@@ -14,16 +14,22 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <sys/wait.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <fcntl.h>
-#include <spawn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "MurmurHash3.h"
+#include "cmz.h"
+#include "cmb.h"
+#include "partfile.h"
+#include "combine.h"
 
 static struct option long_options[] = {
     {.name = "destination",    .has_arg = required_argument, .flag = 0, .val = 'd'},
@@ -32,242 +38,1357 @@ static struct option long_options[] = {
     {.name = "num-partitions", .has_arg = required_argument, .flag = 0, .val = 'n'},
     {.name = "map-id",         .has_arg = required_argument, .flag = 0, .val = 'm'},
     {.name = "sort",           .has_arg = no_argument,       .flag = 0, .val = 'S'},
+    {.name = "sort-memory",    .has_arg = required_argument, .flag = 0, .val = 'M'},
+    {.name = "buffer-memory",  .has_arg = required_argument, .flag = 0, .val = 'B'},
     {.name = "strip-joinkey",  .has_arg = no_argument,       .flag = 0, .val = 's'},
     {.name = "join",           .has_arg = no_argument,       .flag = 0, .val = 'j'},
+    {.name = "threads",        .has_arg = required_argument, .flag = 0, .val = 't'},
+    {.name = "range-partition",.has_arg = required_argument, .flag = 0, .val = 'r'},
+    {.name = "sample",         .has_arg = required_argument, .flag = 0, .val = 'e'},
+    {.name = "hot-keys",       .has_arg = required_argument, .flag = 0, .val = 'H'},
+    {.name = "combine",        .has_arg = required_argument, .flag = 0, .val = 'c'},
+    {.name = "combine-memory", .has_arg = required_argument, .flag = 0, .val = 'C'},
+    {.name = "bloom",          .has_arg = required_argument, .flag = 0, .val = 'b'},
+    {.name = "build-bloom",    .has_arg = required_argument, .flag = 0, .val = 'F'},
+    {.name = "compress",       .has_arg = no_argument,       .flag = 0, .val = 'z'},
+    {.name = "binary",         .has_arg = no_argument,       .flag = 0, .val = 'y'},
+    {.name = "single-file",    .has_arg = no_argument,       .flag = 0, .val = 'g'},
     {0,0,0,0},
 };
-static char short_options[] = "d:D:x:p:k:a:n:m:Ssj";
+static char short_options[] = "d:D:x:p:k:a:n:m:SM:B:sjt:r:e:H:c:C:b:F:zyg";
 
 void usage() {
-    fprintf(stderr, "Usage: <input-stream> | cmr-bucket -x <delimiter> -d <destination folder> -n <num-partitions> -m <map-id> [-p <prefix> -s <sort>]\n");
+    fprintf(stderr, "Usage: <input-stream> | cmr-bucket -x <delimiter> -d <destination folder> -n <num-partitions> -m <map-id> [-p <prefix> -s <sort> --sort-memory <MB> --buffer-memory <MB> --threads <n> --range-partition <splitters> --hot-keys <fanout> --combine <csmM...> --combine-memory <MB> --bloom <filter> --compress --binary --single-file]\n");
+    fprintf(stderr, "       <input-stream> | cmr-bucket -x <delimiter> --sample <every> [-j -s]\n");
+    fprintf(stderr, "       <input-stream> | cmr-bucket -x <delimiter> --build-bloom <MB> [-j -s] > <filter>\n");
 }
 
-// Because omg pipe magic is unreadable
-#define FD_STDIN 0
-#define FD_STDOUT 1
-#define READ_END(x) x[0]
-#define WRITE_END(x) x[1]
+static void write_all(int fd, const char* data, size_t len) {
+    while ( len > 0 ) {
+        ssize_t wr = write(fd, data, len);
+        if ( wr < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            fprintf(stderr, "cmr-bucket: write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        data += wr;
+        len -= wr;
+    }
+}
 
-int main( int argc, char* const argv[] ) {
-    const char* prefix = "part";
-    const char* destination = ".";
-    char delimiter = '\002';
+// --sort: records collect in one memory bounded arena, get sorted by (partition, key, rest of the line) and are
+// spilled as a run whenever it fills. At the end each partition is written as a merge of its piece of every run.
+// Keys are everything up to the delimiter and compare the way cmr-merge does (bytewise, a key before its
+// extensions), so the buckets merge in order.
+#define SORT_MEMORY 128
+#define RUN_BUFFER (256*1024)
+#define OUT_BUFFER (1024*1024)
 
-    int option_index = 0;
-    int num_partitions = -1;
-    int map_id = -1;
-    int join = 0;
-    int strip_joinkey = 0;
-    int sort = 0;
+typedef struct sort_rec_t {
+    unsigned long long prefix; // first 8 bytes of the key, big endian and zero padded
+    char* data;                // always ends in a newline
+    int len;
+    int key_len;
+    int part;
+} sort_rec;
+
+// A spilled run, partition p is at [starts[p], starts[p+1])
+typedef struct sort_run_t {
+    int fd;
+    off_t* starts;
+} sort_run;
+
+static const char* prefix = "part";
+static const char* destination = ".";
+static int map_id = -1;
+static char delimiter = '\002';
+static int num_partitions = -1;
+
+// Partition part goes to prefix-mapid-part, or with --single-file every partition goes to prefix-mapid (part -1)
+static int open_partition(int part) {
+    char path[4096];
+    if ( part < 0 ) {
+        snprintf(path, sizeof(path), "%s/%s-%d", destination, prefix, map_id);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s-%d-%d", destination, prefix, map_id, part);
+    }
+    int fd = open( path, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH );
+    if ( fd < 0 ) {
+        fprintf(stderr, "cmr-bucket: can't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+// Partition files are written through here, framed by cmz.h with --compress. Only one thread ever writes them
+// (sort_finish or the flusher), so one frame buffer does.
+static int compress_out = 0;
+static int binary = 0;      // sorted partitions are written as cmb.h records
+static int single_file = 0; // sorted partitions are laid out in one file, see partfile.h
+static char* cmz_out;
+static size_t cmz_out_size = 0;
+static off_t part_written = 0;
+
+static void write_part(int fd, const char* data, size_t len) {
+    if ( compress_out ) {
+        len = cmz_encode(data, len, &cmz_out, &cmz_out_size);
+        data = cmz_out;
+    }
+    write_all(fd, data, len);
+    part_written += len;
+}
+
+static size_t sort_memory;
+static char* arena;
+static size_t arena_used = 0;
+static sort_rec* recs;
+static size_t num_recs = 0;
+static size_t max_recs = 0;
+static sort_run* runs;
+static int num_runs = 0;
+
+static void set_key(sort_rec* r) {
+    char* end = (char*)memchr(r->data, delimiter, r->len - 1);
+    r->key_len = end ? end - r->data : r->len - 1;
+    r->prefix = 0;
+    for ( int i=0; i<8; i++ ) {
+        r->prefix <<= 8;
+        if ( i < r->key_len ) { r->prefix |= (unsigned char)r->data[i]; }
+    }
+}
+
+static int key_cmp(const char* a, int a_len, const char* b, int b_len) {
+    int result = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if ( result != 0 ) { return result; }
+    return a_len - b_len;
+}
+
+static int rec_cmp(const sort_rec* a, const sort_rec* b) {
+    if ( a->prefix != b->prefix ) { return a->prefix < b->prefix ? -1 : 1; }
+    int result = key_cmp(a->data, a->key_len, b->data, b->key_len);
+    if ( result != 0 ) { return result; }
+    return key_cmp(a->data + a->key_len, a->len - 1 - a->key_len, b->data + b->key_len, b->len - 1 - b->key_len);
+}
+
+static int part_rec_cmp(const void* va, const void* vb) {
+    const sort_rec* a = (const sort_rec*)va;
+    const sort_rec* b = (const sort_rec*)vb;
+    if ( a->part != b->part ) { return a->part - b->part; }
+    return rec_cmp(a, b);
+}
+
+// An unlinked file to hold a run
+static int spill_file() {
+    const char* dir = getenv("TMPDIR");
+    if ( !dir || !*dir ) { dir = "/tmp"; }
+
+    int fd = open(dir, O_TMPFILE|O_RDWR, S_IRUSR|S_IWUSR);
+    if ( fd >= 0 ) { return fd; }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/cmr-bucket-XXXXXX", dir);
+    fd = mkstemp(path);
+    if ( fd >= 0 ) { unlink(path); }
+    return fd;
+}
+
+static void spill_run() {
+    qsort(recs, num_recs, sizeof(sort_rec), part_rec_cmp);
+
+    runs = (sort_run*)realloc(runs, (num_runs+1) * sizeof(sort_run));
+    sort_run* run = &runs[num_runs++];
+    run->fd = spill_file();
+    if ( run->fd < 0 ) {
+        fprintf(stderr, "cmr-bucket: no spill file: %s\n", strerror(errno));
+        exit(1);
+    }
+    run->starts = (off_t*)calloc(num_partitions+1, sizeof(off_t));
+
+    char* out = (char*)malloc(OUT_BUFFER);
+    size_t out_len = 0;
+    off_t off = 0;
+    size_t i = 0;
+    for ( int p=0; p<num_partitions; p++ ) {
+        run->starts[p] = off;
+        for ( ; i<num_recs && recs[i].part == p; i++ ) {
+            if ( out_len + recs[i].len > OUT_BUFFER ) {
+                write_all(run->fd, out, out_len);
+                out_len = 0;
+            }
+            if ( recs[i].len > OUT_BUFFER ) {
+                write_all(run->fd, recs[i].data, recs[i].len);
+            } else {
+                memcpy(&out[out_len], recs[i].data, recs[i].len);
+                out_len += recs[i].len;
+            }
+            off += recs[i].len;
+        }
+    }
+    run->starts[num_partitions] = off;
+    write_all(run->fd, out, out_len);
+    free(out);
+
+    num_recs = 0;
+    arena_used = 0;
+}
+
+static void sort_add(int part, const char* data, int len) {
+    int newline = len > 0 && data[len-1] == '\n';
+    size_t need = len + !newline;
+
+    if ( arena_used + need + (num_recs+1) * sizeof(sort_rec) > sort_memory && num_recs > 0 ) {
+        spill_run();
+    }
+    if ( need > sort_memory ) { // a single huge line, give it the arena to itself
+        sort_memory = need + sizeof(sort_rec);
+        arena = (char*)realloc(arena, sort_memory);
+    }
+    if ( num_recs == max_recs ) {
+        max_recs = max_recs ? max_recs * 2 : 4096;
+        recs = (sort_rec*)realloc(recs, max_recs * sizeof(sort_rec));
+    }
+
+    // Lines are always stored newline terminated, like sort(1) would
+    sort_rec* r = &recs[num_recs++];
+    r->data = &arena[arena_used];
+    memcpy(r->data, data, len);
+    if ( !newline ) { r->data[len] = '\n'; }
+    r->len = need;
+    r->part = part;
+    arena_used += need;
+    set_key(r);
+}
+
+// Where a partition's records come from when merging, a piece of a run or of the sorted arena
+typedef struct sort_source_t {
+    sort_rec cur;
+    // Run
+    int fd;
+    off_t pos;
+    off_t end;
+    char* buf;
+    size_t buf_size;
+    size_t buf_len;
+    size_t at;
+    // Arena
+    sort_rec* next;
+    sort_rec* last;
+} sort_source;
+
+static int source_next(sort_source* s) {
+    if ( !s->buf ) {
+        if ( s->next == s->last ) { return 0; }
+        s->cur = *s->next++;
+        return 1;
+    }
 
     while (1) {
-        int opt = getopt_long(argc, argv, short_options, long_options, &option_index);
-        if (opt < 0) { break; }
-        switch (opt) {
-            case 'd': // destination
-                destination = optarg;
-                break;
-            case 'x': // delimiter
-                delimiter = optarg[0];
-                break;
-            case 'p': // prefix
-                prefix = optarg;
-                break;
-            case 'n': // num-partitions
-                num_partitions = atoi(optarg);
-                break;
-            case 'm': // map-id
-                map_id = atoi(optarg);
-                break;
-            case 'S': // sort
-                sort = 1;
-                break;
-            case 's': // strip-joinkey
-                strip_joinkey = 1;
-                break;
-            case 'j': // join
-                join = 1;
-                break;
-            default:
-                usage();
+        char* start = &s->buf[s->at];
+        char* nl = (char*)memchr(start, '\n', s->buf_len - s->at);
+        if ( nl ) {
+            s->cur.data = start;
+            s->cur.len = nl + 1 - start;
+            s->at += s->cur.len;
+            set_key(&s->cur);
+            return 1;
+        }
+        if ( s->pos >= s->end ) { return 0; }
+
+        memmove(s->buf, start, s->buf_len - s->at);
+        s->buf_len -= s->at;
+        s->at = 0;
+        if ( s->buf_len == s->buf_size ) {
+            s->buf_size *= 2;
+            s->buf = (char*)realloc(s->buf, s->buf_size);
+        }
+        size_t want = s->buf_size - s->buf_len;
+        if ( want > s->end - s->pos ) { want = s->end - s->pos; }
+        ssize_t rd = pread(s->fd, &s->buf[s->buf_len], want, s->pos);
+        if ( rd < 0 && errno == EINTR ) { continue; }
+        if ( rd <= 0 ) {
+            fprintf(stderr, "cmr-bucket: reading run failed: %s\n", rd < 0 ? strerror(errno) : "short read");
+            exit(1);
+        }
+        s->buf_len += rd;
+        s->pos += rd;
+    }
+}
+
+// Min heap of sources, ties go to the earlier source
+static int source_before(sort_source* a, sort_source* b) {
+    int result = rec_cmp(&a->cur, &b->cur);
+    return result < 0 || ( result == 0 && a < b );
+}
+
+static void heap_down(sort_source** heap, int n, int i) {
+    while (1) {
+        int min = i;
+        int l = 2*i+1;
+        int r = 2*i+2;
+        if ( l < n && source_before(heap[l], heap[min]) ) { min = l; }
+        if ( r < n && source_before(heap[r], heap[min]) ) { min = r; }
+        if ( min == i ) { return; }
+        sort_source* t = heap[i];
+        heap[i] = heap[min];
+        heap[min] = t;
+        i = min;
+    }
+}
+
+// Partition output of the merge, gathered into OUT_BUFFER sized writes
+static int part_fd;
+static char* part_buf;
+static size_t part_len = 0;
+
+static void part_append(const char* data, size_t len) {
+    if ( part_len + len > OUT_BUFFER ) {
+        write_part(part_fd, part_buf, part_len);
+        part_len = 0;
+    }
+    if ( len > OUT_BUFFER ) {
+        write_part(part_fd, data, len);
+        return;
+    }
+    memcpy(&part_buf[part_len], data, len);
+    part_len += len;
+}
+
+static void part_sink(void* arg, const char* data, size_t len) {
+    part_append(data, len);
+}
+
+// Sort what's left in the arena and write every partition out merged across the runs
+static void sort_finish() {
+    qsort(recs, num_recs, sizeof(sort_rec), part_rec_cmp);
+
+    sort_source* sources = (sort_source*)calloc(num_runs+1, sizeof(sort_source));
+    sort_source** heap = (sort_source**)calloc(num_runs+1, sizeof(sort_source*));
+    for ( int i=0; i<num_runs; i++ ) {
+        sources[i].fd = runs[i].fd;
+        sources[i].buf_size = RUN_BUFFER;
+        sources[i].buf = (char*)malloc(RUN_BUFFER);
+    }
+
+    part_buf = (char*)malloc(OUT_BUFFER);
+    part_fd = -1;
+    off_t* offsets = (off_t*)calloc(num_partitions+1, sizeof(off_t));
+    size_t r = 0;
+    for ( int p=0; p<num_partitions; p++ ) {
+        offsets[p] = part_written;
+        int n = 0;
+        for ( int i=0; i<num_runs; i++ ) {
+            sort_source* s = &sources[i];
+            s->pos = runs[i].starts[p];
+            s->end = runs[i].starts[p+1];
+            s->buf_len = 0;
+            s->at = 0;
+            if ( source_next(s) ) { heap[n++] = s; }
+        }
+        sort_source* mem = &sources[num_runs];
+        mem->next = &recs[r];
+        for ( ; r<num_recs && recs[r].part == p; r++ );
+        mem->last = &recs[r];
+        if ( source_next(mem) ) { heap[n++] = mem; }
+
+        if ( n == 0 ) { continue; }
+        for ( int i=n/2-1; i>=0; i-- ) {
+            heap_down(heap, n, i);
+        }
+
+        if ( !single_file ) {
+            part_fd = open_partition(p);
+        } else if ( part_fd < 0 ) {
+            part_fd = open_partition(-1);
+        }
+        part_len = 0;
+        cmb_writer w;
+        if ( binary ) { cmb_begin(&w, part_sink, NULL); }
+
+        while ( n > 0 ) {
+            sort_rec* rec = &heap[0]->cur;
+            if ( binary ) {
+                cmb_add(&w, rec->data, rec->key_len, rec->data + rec->key_len, rec->len - 1 - rec->key_len);
+            } else {
+                part_append(rec->data, rec->len);
+            }
+
+            if ( !source_next(heap[0]) ) {
+                heap[0] = heap[--n];
+            }
+            heap_down(heap, n, 0);
+        }
+        if ( binary ) { cmb_end(&w); }
+        write_part(part_fd, part_buf, part_len);
+        if ( !single_file ) { close(part_fd); }
+    }
+    offsets[num_partitions] = part_written;
+
+    if ( single_file && part_fd >= 0 ) {
+        if ( partfile_write_index(part_fd, offsets, num_partitions) < 0 ) {
+            fprintf(stderr, "cmr-bucket: write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        close(part_fd);
+    }
+    free(offsets);
+
+    for ( int i=0; i<num_runs; i++ ) {
+        close(runs[i].fd);
+    }
+}
+
+// Without --sort records are appended to per partition buffers carved from a pool of slabs, and a background
+// flusher writes full slabs to the partition files in the order they filled. The pool is capped (--buffer-memory)
+// and slabs shrink as partitions grow so that partly filled slabs never tie up more than half of it.
+#define BUFFER_MEMORY 64
+#define MAX_SLAB (1024*1024)
+#define MIN_SLAB (16*1024)
+
+typedef struct slab_t {
+    struct slab_t* next; // free list or flush queue
+    int part;
+    size_t len;
+    size_t size;
+    char* data;
+} slab;
+
+static size_t slab_size;
+static size_t max_slabs;
+static size_t num_slabs = 0;
+static slab* free_slabs = NULL;
+static slab* queue_head = NULL;
+static slab* queue_tail = NULL;
+static int flush_done = 0;
+static slab** filling;  // per partition
+static int* part_fds;
+static pthread_t flusher;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;   // a slab came free
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;  // a slab is ready to write
+
+static slab* slab_get() {
+    pthread_mutex_lock(&pool_lock);
+    while ( !free_slabs && num_slabs >= max_slabs ) {
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    slab* s = free_slabs;
+    if ( s ) {
+        free_slabs = s->next;
+    } else {
+        num_slabs++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if ( !s ) {
+        s = (slab*)malloc(sizeof(slab));
+        s->size = slab_size;
+        s->data = (char*)malloc(slab_size);
+    }
+    s->len = 0;
+    return s;
+}
+
+static void slab_queue(slab* s) {
+    s->next = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if ( queue_tail ) {
+        queue_tail->next = s;
+    } else {
+        queue_head = s;
+    }
+    queue_tail = s;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void* flusher_main(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while ( !queue_head && !flush_done ) {
+            pthread_cond_wait(&queue_cond, &pool_lock);
+        }
+        slab* s = queue_head;
+        if ( s ) {
+            queue_head = s->next;
+            if ( !queue_head ) { queue_tail = NULL; }
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if ( !s ) { break; }
+
+        if ( part_fds[s->part] < 0 ) {
+            part_fds[s->part] = open_partition(s->part);
+        }
+        write_part(part_fds[s->part], s->data, s->len);
+
+        pthread_mutex_lock(&pool_lock);
+        s->next = free_slabs;
+        free_slabs = s;
+        pthread_cond_signal(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+static void writer_start(size_t memory) {
+    slab_size = memory / 2 / num_partitions;
+    if ( slab_size > MAX_SLAB ) { slab_size = MAX_SLAB; }
+    if ( slab_size < MIN_SLAB ) { slab_size = MIN_SLAB; }
+    max_slabs = memory / slab_size;
+    if ( max_slabs < 2 * num_partitions ) { max_slabs = 2 * num_partitions; } // tiny caps on wide shuffles
+
+    filling = (slab**)calloc(num_partitions, sizeof(slab*));
+    part_fds = (int*)malloc(num_partitions * sizeof(int));
+    for ( int i=0; i<num_partitions; i++ ) {
+        part_fds[i] = -1;
+    }
+    pthread_create(&flusher, NULL, flusher_main, NULL);
+}
+
+// Slabs of a partition are written in the order they're queued, so data can straddle them
+static void writer_append(int part, const char* data, size_t len) {
+    while ( len > 0 ) {
+        slab* s = filling[part];
+        if ( !s ) {
+            s = filling[part] = slab_get();
+            s->part = part;
+        }
+        size_t n = s->size - s->len;
+        if ( n > len ) { n = len; }
+        memcpy(&s->data[s->len], data, n);
+        s->len += n;
+        data += n;
+        len -= n;
+        if ( s->len == s->size ) {
+            slab_queue(s);
+            filling[part] = NULL;
+        }
+    }
+}
+
+static void writer_finish() {
+    for ( int i=0; i<num_partitions; i++ ) {
+        if ( filling[i] ) { slab_queue(filling[i]); }
+    }
+    pthread_mutex_lock(&pool_lock);
+    flush_done = 1;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&pool_lock);
+    pthread_join(flusher, NULL);
+
+    for ( int i=0; i<num_partitions; i++ ) {
+        if ( part_fds[i] >= 0 ) { close(part_fds[i]); }
+    }
+}
+
+static int join = 0;
+static int strip_joinkey = 0;
+static int sort = 0;
+static unsigned __int128 kr_size;
+
+// --range-partition: partition p holds the keys from splitter p-1 up to (not including) splitter p
+static char** splitters = NULL;
+static int* splitter_lens;
+
+static void load_splitters(const char* path) {
+    FILE* f = fopen(path, "r");
+    if ( !f ) {
+        fprintf(stderr, "cmr-bucket: can't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    splitters = (char**)malloc(num_partitions * sizeof(char*));
+    splitter_lens = (int*)malloc(num_partitions * sizeof(int));
+
+    int n = 0;
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t rd;
+    while ( ( rd = getline(&line, &size, f) ) > 0 ) {
+        if ( line[rd-1] == '\n' ) { rd--; }
+        if ( n < num_partitions - 1 ) {
+            splitters[n] = (char*)malloc(rd);
+            memcpy(splitters[n], line, rd);
+            splitter_lens[n] = rd;
+            if ( n > 0 && key_cmp(splitters[n-1], splitter_lens[n-1], splitters[n], rd) >= 0 ) {
+                fprintf(stderr, "cmr-bucket: splitters in %s aren't sorted and distinct\n", path);
                 exit(1);
-                break;
+            }
         }
+        n++;
     }
+    free(line);
+    fclose(f);
 
-    if ( num_partitions == -1 || map_id == -1 ) {
-        usage();
+    if ( n != num_partitions - 1 ) {
+        fprintf(stderr, "cmr-bucket: %s has %d splitters, %d partitions need %d\n", path, n, num_partitions, num_partitions - 1);
         exit(1);
     }
+}
 
-    char *chunky_bin_path = (char*)malloc(256);
-    sprintf(chunky_bin_path, "chunky");
-    char *chunky_size_flag = (char*)malloc(256);
-    sprintf(chunky_size_flag, "-s");
-    char *chunky_size = (char*)malloc(256);
-    sprintf(chunky_size, "4");
+static int range_of(const char* key, int len) {
+    int lo = 0;
+    int hi = num_partitions - 1;
+    while ( lo < hi ) {
+        int mid = lo + (hi - lo) / 2;
+        if ( key_cmp(key, len, splitters[mid], splitter_lens[mid]) < 0 ) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
 
-    char * chunkyArgs[] = { chunky_bin_path, chunky_size_flag, chunky_size, NULL };
+// Finds the key of a line, NULL if it has none. *data is set to the part of the line that gets written.
+static char* key_of(char* line, int rd, int* key_len, char** data) {
+    char* joinkey_pos = line;
+    char* pos;
 
+    if (strip_joinkey) {
+        while(joinkey_pos[0] != delimiter) {
+            joinkey_pos++;
+            if (joinkey_pos >= line+rd) { return NULL; }
+        }
+        joinkey_pos++;
+    }
+
+    // Joins partition on the join key even when it isn't written, otherwise a stripped join key isn't part of the key
+    char* key_pos = join ? line : joinkey_pos;
+    pos = key_pos;
+    while(pos < line+rd && pos[0] != delimiter) {
+        pos++;
+    }
+    if (pos >= line+rd) { return NULL; }
 
-    char *sort_bin_path = (char*)malloc(256);
-    sprintf(sort_bin_path, "/usr/bin/sort");
-    char *sort_arg = (char*)malloc(256);
-    sprintf(sort_arg, "--buffer-size=16M");
+    *key_len = pos - key_pos;
+    *data = strip_joinkey ? joinkey_pos : line;
+    return key_pos;
+}
 
+// --hot-keys: lines sampled evenly through every block are counted with a space saving counter. A key carrying more
+// than an average partition's share of the samples is hot from the block it turned hot in on, and its lines are spread
+// over the <fanout> partitions starting at its own, picked by a hash of the line number. Hot keys are listed in
+// <prefix>-<map-id>.hot as "<partition> <fanout> <key>", so the client knows which buckets hold their rows.
+#define HOT_COUNTERS 64
+#define HOT_SAMPLES 4096  // per block
+#define HOT_MIN_COUNT 256 // samples
+#define HOT_MAX 256
 
-    pid_t pids[1024];
-    posix_spawn_file_actions_t action;
-    char * spawnedArgs[] = { sort_bin_path, sort_arg, NULL };
+typedef struct hot_key_t {
+    char* key;
+    int len;
+    long long count;
+    long long error;  // count the key may have inherited from the one it replaced
+    uint64_t hash;
+    int part;
+} hot_key;
 
-    unsigned __int128 kr_max = -1;
-    unsigned __int128 kr_size = kr_max / num_partitions;
+static int hot_fanout = 0;
+static hot_key counters[HOT_COUNTERS];
+static int num_counters = 0;
+static hot_key* hot_keys;
+static int num_hot = 0;
+
+static void hot_count(const char* key, int len) {
+    int min = 0;
+    for ( int i=0; i<num_counters; i++ ) {
+        if ( counters[i].len == len && memcmp(counters[i].key, key, len) == 0 ) {
+            counters[i].count++;
+            return;
+        }
+        if ( counters[i].count < counters[min].count ) { min = i; }
+    }
+
+    hot_key* c;
+    if ( num_counters < HOT_COUNTERS ) {
+        c = &counters[num_counters++];
+        c->key = NULL;
+        c->count = c->error = 0;
+    } else {
+        c = &counters[min];
+        c->error = c->count;
+    }
+    c->key = (char*)realloc(c->key, len ? len : 1);
+    memcpy(c->key, key, len);
+    c->len = len;
+    c->count++;
+}
 
-    int* write_fds = (int*)calloc(num_partitions, sizeof(int));
-    
-    int failed = 0;
-    int nagg = 0;
-    int nkey = 0;
+static long long hot_sampled = 0;
+
+// Count a sample of the lines of a block, then add the keys that turned hot. Hot keys are only ever added, a block
+// is partitioned with the ones there were when it was read.
+static void hot_sample(char* data, size_t len) {
+    char* end = data + len;
+    size_t step = len / HOT_SAMPLES > 0 ? len / HOT_SAMPLES : 1;
+    char* out;
+    int key_len;
+
+    for ( char* pos = data; pos < end; pos += step ) {
+        // The line starting after pos, the first one of the block at the start
+        char* line = pos;
+        if ( pos > data ) {
+            line = (char*)memchr(pos, '\n', end - pos);
+            if ( !line ) { break; }
+            line++;
+        }
+        char* nl = (char*)memchr(line, '\n', end - line);
+        char* next = nl ? nl + 1 : end;
+        char* key = key_of(line, next - line, &key_len, &out);
+        if ( key ) {
+            hot_count(key, key_len);
+            hot_sampled++;
+        }
+    }
+
+    if ( !hot_keys ) { hot_keys = (hot_key*)malloc(HOT_MAX * sizeof(hot_key)); }
+    for ( int i=0; i<num_counters && num_hot < HOT_MAX; i++ ) {
+        long long count = counters[i].count - counters[i].error;
+        if ( count < HOT_MIN_COUNT || count * num_partitions <= hot_sampled ) { continue; }
+
+        uint64_t hash[2];
+        __int128 key;
+        MurmurHash3_x64_128( counters[i].key, counters[i].len, 0, hash );
+        int known = 0;
+        for ( int j=0; j<num_hot && !known; j++ ) {
+            known = hot_keys[j].hash == hash[0] && hot_keys[j].len == counters[i].len && memcmp(hot_keys[j].key, counters[i].key, counters[i].len) == 0;
+        }
+        if ( known ) { continue; }
+
+        memcpy(&key, hash, sizeof(key));
+        hot_keys[num_hot] = counters[i];
+        hot_keys[num_hot].key = (char*)malloc(counters[i].len ? counters[i].len : 1);
+        memcpy(hot_keys[num_hot].key, counters[i].key, counters[i].len);
+        hot_keys[num_hot].hash = hash[0];
+        hot_keys[num_hot].part = (int) (key / kr_size);
+        num_hot++;
+    }
+}
+
+static void hot_write() {
+    if ( num_hot == 0 ) { return; }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s-%d.hot", destination, prefix, map_id);
+    FILE* f = fopen(path, "w");
+    if ( !f ) {
+        fprintf(stderr, "cmr-bucket: can't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    for ( int i=0; i<num_hot; i++ ) {
+        fprintf(f, "%d %d ", hot_keys[i].part, hot_fanout);
+        fwrite(hot_keys[i].key, 1, hot_keys[i].len, f);
+        fputc('\n', f);
+    }
+    fclose(f);
+}
+
+// --bloom: lines whose key isn't in the filter are dropped, --build-bloom writes the filter of the keys read instead.
+// A filter is a plain bitmap, a key sets BLOOM_HASHES bits picked with its partitioning hash. Filters of the same
+// size OR together.
+#define BLOOM_HASHES 7
+
+static unsigned char* bloom = NULL;
+static uint64_t bloom_bits;
+
+static void load_bloom(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ( fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0 ) {
+        fprintf(stderr, "cmr-bucket: can't read bloom filter %s\n", path);
+        exit(1);
+    }
+    bloom = (unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( bloom == MAP_FAILED ) {
+        fprintf(stderr, "cmr-bucket: can't map bloom filter %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    bloom_bits = (uint64_t)st.st_size * 8;
+    close(fd);
+}
+
+static int bloom_has(const uint64_t* hash) {
+    for ( int i=0; i<BLOOM_HASHES; i++ ) {
+        uint64_t bit = (hash[0] + i * hash[1]) % bloom_bits;
+        if ( !( bloom[bit >> 3] & (1 << (bit & 7)) ) ) { return 0; }
+    }
+    return 1;
+}
+
+// The partition of a line, or -1 if it has no key. A line of one of the first hot keys (those known once its
+// block was sampled) goes to the partition its line number in the input, line_no, picks.
+static int partition_of(char* line, int rd, long long line_no, int hot, char** data) {
+    int key_len;
+    uint64_t hash[2];
+    __int128 key;
+
+    char* key_pos = key_of(line, rd, &key_len, data);
+    if ( !key_pos ) { return -1; }
+
+    if ( splitters ) {
+        if ( bloom ) {
+            MurmurHash3_x64_128( key_pos, key_len, 0, hash );
+            if ( !bloom_has(hash) ) { return -1; }
+        }
+        return range_of(key_pos, key_len);
+    }
+
+    MurmurHash3_x64_128( key_pos, key_len, 0, hash );
+    if ( bloom && !bloom_has(hash) ) { return -1; }
+    // Not through a cast, the hash is written as uint64_t and the optimizer is free to read a stale key otherwise
+    memcpy(&key, hash, sizeof(key));
+    int part = (int) (key / kr_size);
+
+    for ( int i=0; i<hot; i++ ) {
+        if ( hot_keys[i].hash == hash[0] && hot_keys[i].len == key_len && memcmp(hot_keys[i].key, key_pos, key_len) == 0 ) {
+            // Mixed, so lines of a key that come at a regular stride still spread out
+            uint64_t salt = (uint64_t)line_no * 0x9E3779B97F4A7C15ULL;
+            return (part + (salt >> 32) % hot_fanout) % num_partitions;
+        }
+    }
+    return part;
+}
+
+// --sample: write the key of every nth line instead of bucketing, the client picks range splitters from these
+static void sample_keys(int every) {
     int rd = 0;
+    long long n = 0;
     size_t buffer_size = 65535*4;
     char* buf = (char*)malloc(buffer_size * sizeof(char));
-    char* path = (char*)malloc(4096);
-    char* pos = buf;
-    char* joinkey_pos = buf;
-    __int128 key;
+    char* data;
+    int key_len;
 
-    int so_many_processes = 0;
+    while ( ( rd = getline(&buf, &buffer_size, stdin) ) > 0 ) {
+        char* key = key_of(buf, rd, &key_len, &data);
+        if ( !key || n++ % every != 0 ) { continue; }
+        fwrite(key, 1, key_len, stdout);
+        fputc('\n', stdout);
+    }
+}
+
+static void build_bloom(size_t size) {
+    int rd = 0;
+    size_t buffer_size = 65535*4;
+    char* buf = (char*)malloc(buffer_size * sizeof(char));
+    char* data;
+    int key_len;
+    uint64_t hash[2];
 
+    bloom_bits = (uint64_t)size * 8;
+    unsigned char* filter = (unsigned char*)calloc(size, 1);
     while ( ( rd = getline(&buf, &buffer_size, stdin) ) > 0 ) {
-        failed = 0;
-        nagg = 0;
-        nkey = 0;
-        joinkey_pos = buf;
-
-        if (strip_joinkey) {
-            while(joinkey_pos[0] != delimiter) {
-                joinkey_pos++;
-                if (joinkey_pos > buf+rd) { failed = 1; break; }
-            }
-            joinkey_pos++;
+        char* key = key_of(buf, rd, &key_len, &data);
+        if ( !key ) { continue; }
+        MurmurHash3_x64_128( key, key_len, 0, hash );
+        for ( int i=0; i<BLOOM_HASHES; i++ ) {
+            uint64_t bit = (hash[0] + i * hash[1]) % bloom_bits;
+            filter[bit >> 3] |= 1 << (bit & 7);
         }
-        if (failed) { continue; }
+    }
+    write_all(1, (char*)filter, size);
+}
 
-        if (join) {
-            pos = buf;
-            while(pos[0] != delimiter) {
-                pos++;
-                if (pos > buf+rd) { failed = 1; break; }
-            }
-        } else {
-            pos = joinkey_pos;
-            while(pos[0] != delimiter) {
-                pos++;
-                if (pos > buf+rd) { failed = 1; break; }
-            }
-        }
-        if (failed) { continue; }
+static void output(int part, const char* data, size_t len) {
+    if (sort) {
+        sort_add( part, data, len );
+    }
+    else {
+        writer_append( part, data, len );
+    }
+}
 
-        if (strip_joinkey) {
-            // If we're stripping the join key, don't use it as part of the hash
-            MurmurHash3_x64_128( joinkey_pos, pos-joinkey_pos, 0, &key );
+// --combine: rows are aggregated per key and partition in a memory bounded hash table before they're bucketed,
+// the way cmr-merge --combine folds them (see combine.h). The partition is part of the key, so a hot key salted
+// over several partitions keeps a row in each. The table is flushed as partial rows whenever it fills, and they
+// combine again in the merge.
+#define COMBINE_MEMORY 64
+
+typedef struct comb_entry_t {
+    struct comb_entry_t* next; // in the order keys were first seen
+    uint64_t hash;
+    int part;
+    int key_len;
+    char* key;
+    agg_state aggs[];
+} comb_entry;
+
+static char agg_types[COMBINE_MAX_AGGS];
+static int num_aggs = 0;
+static size_t combine_memory;
+static char* comb_arena;
+static size_t comb_used = 0;
+static comb_entry** comb_table;
+static size_t comb_size;   // slots, a power of two
+static size_t comb_count = 0;
+static comb_entry* comb_head = NULL;
+static comb_entry* comb_tail = NULL;
+static char* comb_line;
+static size_t comb_line_size = 0;
+
+// Callers make sure there's room first
+static void* comb_alloc(size_t len) {
+    len = (len + 7) & ~(size_t)7;
+    void* p = &comb_arena[comb_used];
+    comb_used += len;
+    return p;
+}
+
+// Kept fields live in the arena too, a longer winner gets a new copy
+static char* comb_keep(char* old, int old_len, int len) {
+    return ( old && len <= old_len ) ? old : (char*)comb_alloc(len + 1);
+}
+
+static void combine_start(size_t memory) {
+    combine_memory = memory;
+    comb_arena = (char*)malloc(combine_memory);
+    // Room for an entry every 64 bytes of arena at half load
+    comb_size = 1024;
+    while ( comb_size < combine_memory / 32 ) { comb_size *= 2; }
+    comb_table = (comb_entry**)calloc(comb_size, sizeof(comb_entry*));
+}
+
+static void combine_flush() {
+    for ( comb_entry* e = comb_head; e; e = e->next ) {
+        size_t len = combine_row_size(agg_types, num_aggs, e->aggs, e->key_len);
+        if ( len > comb_line_size ) {
+            comb_line_size = len * 2;
+            comb_line = (char*)realloc(comb_line, comb_line_size);
         }
-        else {
-            MurmurHash3_x64_128( buf, pos-buf, 0, &key );
+        len = combine_row(comb_line, e->key, e->key_len, agg_types, num_aggs, e->aggs);
+        output(e->part, comb_line, len);
+    }
+
+    memset(comb_table, 0, comb_size * sizeof(comb_entry*));
+    comb_count = 0;
+    comb_used = 0;
+    comb_head = comb_tail = NULL;
+}
+
+static void combine_add(int part, const char* data, size_t len) {
+    const char* end = data + len;
+    if ( len > 0 && end[-1] == '\n' ) { end--; }
+
+    const char* pos = combine_key_end(data, end, num_aggs);
+    if ( !pos ) {
+        // Short line, passes through as is
+        output(part, data, len);
+        return;
+    }
+    int key_len = pos - data;
+
+    // The most a row can take from the arena: a new entry, its key and every field kept as text
+    size_t need = sizeof(comb_entry) + num_aggs * (sizeof(agg_state) + 8) + key_len + (end - pos) + 16;
+    if ( need > combine_memory ) {
+        output(part, data, len);
+        return;
+    }
+    if ( comb_used + need > combine_memory || comb_count * 2 >= comb_size ) {
+        combine_flush();
+    }
+
+    uint64_t hash[2];
+    MurmurHash3_x64_128( data, key_len, part, hash );
+
+    size_t slot = hash[0] & (comb_size - 1);
+    comb_entry* e;
+    while ( ( e = comb_table[slot] ) ) {
+        if ( e->hash == hash[0] && e->part == part && e->key_len == key_len && memcmp(e->key, data, key_len) == 0 ) {
+            combine_fold(agg_types, num_aggs, e->aggs, pos, end, 0, comb_keep);
+            return;
         }
+        slot = (slot + 1) & (comb_size - 1);
+    }
 
-        int out_id = (int) (key / kr_size);
+    e = (comb_entry*)comb_alloc(sizeof(comb_entry) + num_aggs * sizeof(agg_state));
+    memset(e, 0, sizeof(comb_entry) + num_aggs * sizeof(agg_state));
+    e->hash = hash[0];
+    e->part = part;
+    e->key_len = key_len;
+    e->key = (char*)comb_alloc(key_len);
+    memcpy(e->key, data, key_len);
+    combine_fold(agg_types, num_aggs, e->aggs, pos, end, 1, comb_keep);
 
-        if ( write_fds[out_id] == 0 ) {
-            // oh god, forks
-            int sort_pipe[2];
-            int chunky_pipe[2];
+    comb_table[slot] = e;
+    comb_count++;
+    if ( comb_tail ) { comb_tail->next = e; } else { comb_head = e; }
+    comb_tail = e;
+}
 
-            if (sort) {
-                pipe(sort_pipe);
-            }
+static void emit(int part, char* data, size_t len) {
+    if ( num_aggs > 0 ) {
+        combine_add( part, data, len );
+    }
+    else {
+        output( part, data, len );
+    }
+}
 
-            pipe(chunky_pipe);
+// --threads: stdin is read in large blocks cut at the last newline. Workers find the partition of every line in a
+// block and scatter the block into one contiguous region per partition, and the main thread hands the regions of
+// each block on in input order, so the buckets come out exactly as they do from a single thread.
+#define BLOCK_SIZE (4*1024*1024)
+#define MAX_THREADS 64
 
+enum { BLOCK_FREE, BLOCK_FILLED, BLOCK_BUSY, BLOCK_DONE };
 
-            // -- Open up the output file
-            sprintf(path, "%s/%s-%d-%d", destination, prefix, map_id, out_id);
-            int fd = open( path, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH );
+typedef struct block_t {
+    int state;
+    char* data;
+    size_t len;
+    size_t size;
+    char* scatter;   // data regrouped by partition
+    size_t* starts;  // partition p is at [starts[p], starts[p+1]) of scatter
+    int* parts;      // per line, -1 to drop it
+    size_t* lines;   // per line, start and length of what gets written
+    size_t num_lines;
+    long long seq;   // lines read before this one, counted only for --hot-keys
+    int num_hot;     // hot keys known when it was read
+    size_t max_lines;
+} block;
 
-            if (sort) {
-                // -- Spawn Sort
+static block* blocks;
+static int num_blocks;
+static int next_work = 0;
+static int work_done = 0;
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t block_cond = PTHREAD_COND_INITIALIZER;
 
-                posix_spawn_file_actions_init(&action);
-                posix_spawn_file_actions_adddup2(&action,  READ_END(sort_pipe),    FD_STDIN);
-                posix_spawn_file_actions_adddup2(&action,  WRITE_END(chunky_pipe), FD_STDOUT);
+static void scatter_block(block* b) {
+    char* end = b->data + b->len;
+    char* line = b->data;
+    b->num_lines = 0;
+    memset(b->starts, 0, (num_partitions+1) * sizeof(size_t));
 
-                posix_spawn_file_actions_addclose(&action, READ_END(chunky_pipe));
-                posix_spawn_file_actions_addclose(&action, WRITE_END(sort_pipe));
-                posix_spawn_file_actions_addclose(&action, fd);
+    while ( line < end ) {
+        char* nl = (char*)memchr(line, '\n', end - line);
+        char* next = nl ? nl + 1 : end;
+        if ( b->num_lines == b->max_lines ) {
+            b->max_lines *= 2;
+            b->parts = (int*)realloc(b->parts, b->max_lines * sizeof(int));
+            b->lines = (size_t*)realloc(b->lines, b->max_lines * 2 * sizeof(size_t));
+        }
+        char* data = line;
+        int part = partition_of(line, next - line, b->seq + b->num_lines, b->num_hot, &data);
+        b->parts[b->num_lines] = part;
+        b->lines[2*b->num_lines] = data - b->data;
+        b->lines[2*b->num_lines+1] = next - data;
+        if ( part >= 0 ) { b->starts[part+1] += next - data; }
+        b->num_lines++;
+        line = next;
+    }
 
-                posix_spawnp(&pids[so_many_processes++], spawnedArgs[0], &action, NULL, spawnedArgs, NULL);
-            }
+    for ( int p=0; p<num_partitions; p++ ) {
+        b->starts[p+1] += b->starts[p];
+    }
+    size_t* fill = (size_t*)malloc(num_partitions * sizeof(size_t));
+    memcpy(fill, b->starts, num_partitions * sizeof(size_t));
+    for ( size_t i=0; i<b->num_lines; i++ ) {
+        int part = b->parts[i];
+        if ( part < 0 ) { continue; }
+        memcpy(&b->scatter[fill[part]], &b->data[b->lines[2*i]], b->lines[2*i+1]);
+        fill[part] += b->lines[2*i+1];
+    }
+    free(fill);
+}
 
+static void* worker_main(void* arg) {
+    pthread_mutex_lock(&block_lock);
+    while (1) {
+        while ( blocks[next_work].state != BLOCK_FILLED && !work_done ) {
+            pthread_cond_wait(&block_cond, &block_lock);
+        }
+        if ( blocks[next_work].state != BLOCK_FILLED ) { break; }
+        block* b = &blocks[next_work];
+        b->state = BLOCK_BUSY;
+        next_work = (next_work + 1) % num_blocks;
+        pthread_mutex_unlock(&block_lock);
 
-            // -- Spawn Chunky
-            posix_spawn_file_actions_init(&action);
+        scatter_block(b);
 
-            posix_spawn_file_actions_adddup2(&action, READ_END(chunky_pipe), FD_STDIN);
-            posix_spawn_file_actions_adddup2(&action, fd,                    FD_STDOUT);
+        pthread_mutex_lock(&block_lock);
+        b->state = BLOCK_DONE;
+        pthread_cond_broadcast(&block_cond);
+    }
+    pthread_mutex_unlock(&block_lock);
+    return NULL;
+}
 
-            posix_spawn_file_actions_addclose(&action, WRITE_END(chunky_pipe));
+// Fills a block with whole lines, the partial line at the end is carried over to the next one
+static int read_block(block* b, char** carry, size_t* carry_len, size_t* carry_size) {
+    int eof = 0;
+    if ( b->size < *carry_size ) {
+        b->size = *carry_size;
+        b->data = (char*)realloc(b->data, b->size);
+        b->scatter = (char*)realloc(b->scatter, b->size);
+    }
+    memcpy(b->data, *carry, *carry_len);
+    b->len = *carry_len;
+    *carry_len = 0;
 
-            if (sort) {
-                posix_spawn_file_actions_addclose(&action, READ_END(sort_pipe));
-                posix_spawn_file_actions_addclose(&action, WRITE_END(sort_pipe));
+    while (1) {
+        while ( b->len < b->size ) {
+            ssize_t r = read(0, &b->data[b->len], b->size - b->len);
+            if ( r < 0 && errno == EINTR ) { continue; }
+            if ( r < 0 ) {
+                perror("cmr-bucket: read");
+                exit(1);
+            }
+            if ( r == 0 ) {
+                eof = 1;
+                break;
             }
+            b->len += r;
+        }
+        if ( eof ) { return b->len > 0; }
 
-            posix_spawnp(&pids[so_many_processes++], chunkyArgs[0], &action, NULL, chunkyArgs, NULL);
+        char* nl = (char*)memrchr(b->data, '\n', b->len);
+        if ( nl ) {
+            *carry_len = b->data + b->len - (nl + 1);
+            memcpy(*carry, nl + 1, *carry_len);
+            b->len = nl + 1 - b->data;
+            return 1;
+        }
 
-            // Done spawning processes, clean up fds on this process
+        // A line longer than the block
+        b->size *= 2;
+        b->data = (char*)realloc(b->data, b->size);
+        b->scatter = (char*)realloc(b->scatter, b->size);
+        *carry_size = b->size;
+        *carry = (char*)realloc(*carry, *carry_size);
+    }
+}
 
-            // this process doesn't need to write to the output file
-            close(fd);
+static void emit_block(block* b) {
+    pthread_mutex_lock(&block_lock);
+    while ( b->state != BLOCK_DONE ) {
+        pthread_cond_wait(&block_cond, &block_lock);
+    }
+    pthread_mutex_unlock(&block_lock);
 
-            // this process doesn't read from sort or chunky
-            if (sort) {
-                close(READ_END(sort_pipe));
-            }
-            close(READ_END(chunky_pipe));
+    for ( int p=0; p<num_partitions; p++ ) {
+        char* data = &b->scatter[b->starts[p]];
+        size_t len = b->starts[p+1] - b->starts[p];
+        if ( len == 0 ) { continue; }
+        if ( !sort && num_aggs == 0 ) {
+            writer_append( p, data, len );
+            continue;
+        }
+        while ( len > 0 ) {
+            char* nl = (char*)memchr(data, '\n', len);
+            size_t n = nl ? nl + 1 - data : len;
+            emit( p, data, n );
+            data += n;
+            len -= n;
+        }
+    }
+    b->state = BLOCK_FREE;
+}
 
+static void bucket_threaded(int num_threads) {
+    num_blocks = 2 * num_threads;
+    blocks = (block*)calloc(num_blocks, sizeof(block));
+    for ( int i=0; i<num_blocks; i++ ) {
+        blocks[i].size = BLOCK_SIZE;
+        blocks[i].data = (char*)malloc(BLOCK_SIZE);
+        blocks[i].scatter = (char*)malloc(BLOCK_SIZE);
+        blocks[i].starts = (size_t*)malloc((num_partitions+1) * sizeof(size_t));
+        blocks[i].max_lines = 4096;
+        blocks[i].parts = (int*)malloc(blocks[i].max_lines * sizeof(int));
+        blocks[i].lines = (size_t*)malloc(blocks[i].max_lines * 2 * sizeof(size_t));
+    }
+    size_t carry_size = BLOCK_SIZE;
+    size_t carry_len = 0;
+    char* carry = (char*)malloc(carry_size);
 
-            if (sort) {
-              // if sorting, this process isn't writing to chunky
-              close(WRITE_END(chunky_pipe));
-              write_fds[out_id] = WRITE_END(sort_pipe);
-            } else {
-              write_fds[out_id] = WRITE_END(chunky_pipe);
+    pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    for ( int i=0; i<num_threads; i++ ) {
+        pthread_create(&threads[i], NULL, worker_main, NULL);
+    }
+
+    // Blocks are filled and emitted round robin, a block is emitted right before it's refilled
+    long long filled = 0;
+    long long lines_read = 0;
+    int i = 0;
+    while (1) {
+        block* b = &blocks[i];
+        if ( filled >= num_blocks ) { emit_block(b); }
+        if ( !read_block(b, &carry, &carry_len, &carry_size) ) { break; }
+        b->seq = lines_read;
+        if ( hot_fanout ) {
+            // Before any worker sees it, its lines are partitioned knowing the hot keys found so far
+            hot_sample(b->data, b->len);
+            for ( char* nl = b->data; ( nl = (char*)memchr(nl, '\n', b->data + b->len - nl) ); nl++ ) {
+                lines_read++;
             }
-            
-            // Set close on exec on our write fd, we don't want this fd in any subsequent spawned process
-            fcntl(write_fds[out_id], F_SETFD, FD_CLOEXEC);
         }
+        b->num_hot = num_hot;
+        pthread_mutex_lock(&block_lock);
+        b->state = BLOCK_FILLED;
+        pthread_cond_broadcast(&block_cond);
+        pthread_mutex_unlock(&block_lock);
+        filled++;
+        i = (i + 1) % num_blocks;
+    }
+    for ( int n=1; n<num_blocks; n++ ) {
+        int j = (i + n) % num_blocks;
+        if ( blocks[j].state != BLOCK_FREE ) { emit_block(&blocks[j]); }
+    }
 
-        // Done pipe magic
+    pthread_mutex_lock(&block_lock);
+    work_done = 1;
+    pthread_cond_broadcast(&block_cond);
+    pthread_mutex_unlock(&block_lock);
+    for ( int t=0; t<num_threads; t++ ) {
+        pthread_join(threads[t], NULL);
+    }
+}
 
-        // Write the data
-        if (strip_joinkey) {
-            write( write_fds[out_id], joinkey_pos, rd - (joinkey_pos - buf) );
-        }
-        else {
-            write( write_fds[out_id], buf, rd );
+int main( int argc, char* const argv[] ) {
+    int option_index = 0;
+    size_t buffer_memory = BUFFER_MEMORY;
+    int num_threads = 1;
+    const char* splitter_file = NULL;
+    int sample = 0;
+    const char* bloom_file = NULL;
+    int bloom_size = 0;
+
+    while (1) {
+        int opt = getopt_long(argc, argv, short_options, long_options, &option_index);
+        if (opt < 0) { break; }
+        switch (opt) {
+            case 'd': // destination
+                destination = optarg;
+                break;
+            case 'x': // delimiter
+                delimiter = optarg[0];
+                break;
+            case 'p': // prefix
+                prefix = optarg;
+                break;
+            case 'n': // num-partitions
+                num_partitions = atoi(optarg);
+                break;
+            case 'm': // map-id
+                map_id = atoi(optarg);
+                break;
+            case 'S': // sort
+                sort = 1;
+                break;
+            case 'M': // sort-memory
+                sort_memory = atoi(optarg);
+                break;
+            case 'B': // buffer-memory
+                buffer_memory = atoi(optarg);
+                break;
+            case 's': // strip-joinkey
+                strip_joinkey = 1;
+                break;
+            case 'j': // join
+                join = 1;
+                break;
+            case 't': // threads
+                num_threads = atoi(optarg);
+                if ( num_threads < 1 ) { num_threads = 1; }
+                if ( num_threads > MAX_THREADS ) { num_threads = MAX_THREADS; }
+                break;
+            case 'r': // range-partition
+                splitter_file = optarg;
+                break;
+            case 'e': // sample
+                sample = atoi(optarg);
+                break;
+            case 'H': // hot-keys
+                hot_fanout = atoi(optarg);
+                break;
+            case 'c': // combine
+                num_aggs = combine_parse(optarg, agg_types);
+                break;
+            case 'C': // combine-memory
+                combine_memory = atoi(optarg);
+                break;
+            case 'b': // bloom
+                bloom_file = optarg;
+                break;
+            case 'F': // build-bloom
+                bloom_size = atoi(optarg);
+                break;
+            case 'z': // compress
+                compress_out = 1;
+                break;
+            case 'y': // binary
+                binary = 1;
+                break;
+            case 'g': // single-file
+                single_file = 1;
+                break;
+            default:
+                usage();
+                exit(1);
+                break;
         }
     }
 
-    // Done processing, close all of our write fds
-    for ( int i=0; i<num_partitions; i++ ) {
-        if ( write_fds[i] != 0 ) { close(write_fds[i]); }
+    if ( sample > 0 ) {
+        sample_keys(sample);
+        return 0;
+    }
+    if ( bloom_size > 0 ) {
+        build_bloom((size_t)bloom_size * 1024 * 1024);
+        return 0;
     }
 
-    // Wait for all of our children to die...
-    int status;
-    for ( int i=0; i<so_many_processes; i++ ) {
-        waitpid(pids[i], &status, 0);
+    if ( num_partitions == -1 || map_id == -1 ) {
+        usage();
+        exit(1);
     }
 
+    // The block index is over sorted records, and partitions only come out one after another from the sort
+    if ( binary || single_file ) { sort = 1; }
+
+    if ( sort ) {
+        sort_memory = ( sort_memory > 0 ? sort_memory : SORT_MEMORY ) * 1024 * 1024;
+        arena = (char*)malloc(sort_memory);
+    } else {
+        writer_start(buffer_memory * 1024 * 1024);
+    }
+    if ( num_aggs > 0 ) {
+        combine_start(( combine_memory > 0 ? combine_memory : COMBINE_MEMORY ) * 1024 * 1024);
+    }
+
+    unsigned __int128 kr_max = -1;
+    kr_size = kr_max / num_partitions;
+    if ( splitter_file ) {
+        load_splitters(splitter_file);
+    }
+    if ( bloom_file ) {
+        load_bloom(bloom_file);
+    }
+    // Salting spreads a key over partitions, range partitions have to keep every key in one
+    if ( splitter_file || hot_fanout < 2 ) { hot_fanout = 0; }
+    if ( hot_fanout > num_partitions ) { hot_fanout = num_partitions; }
+
+    // Hot keys are sampled a block at a time, single threaded runs read blocks too so they find the same ones
+    if ( num_threads > 1 || hot_fanout ) {
+        bucket_threaded(num_threads);
+    } else {
+        int rd = 0;
+        size_t buffer_size = 65535*4;
+        char* buf = (char*)malloc(buffer_size * sizeof(char));
+        char* data;
+
+        while ( ( rd = getline(&buf, &buffer_size, stdin) ) > 0 ) {
+            int out_id = partition_of(buf, rd, 0, 0, &data);
+            if ( out_id < 0 ) { continue; }
+            emit( out_id, data, rd - (data - buf) );
+        }
+    }
+
+    if ( num_aggs > 0 ) {
+        combine_flush();
+    }
+    if (sort) {
+        sort_finish();
+    } else {
+        writer_finish();
+    }
+    hot_write();
 }
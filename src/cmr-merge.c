@@ -19,43 +19,865 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <dirent.h>
 #include <glob.h>
 #include <getopt.h>
 
+#include "cmz.h"
+#include "cmb.h"
+#include "partfile.h"
+#include "combine.h"
+
 static struct option long_options[] = {
     {.name = "delimiter",     .has_arg = required_argument, .flag = 0, .val = 'x'},
+    {.name = "combine",       .has_arg = required_argument, .flag = 0, .val = 'c'},
+    {.name = "threads",       .has_arg = required_argument, .flag = 0, .val = 't'},
+    {.name = "binary",        .has_arg = no_argument,       .flag = 0, .val = 'y'},
+    {.name = "hot-keys",      .has_arg = required_argument, .flag = 0, .val = 'H'},
+    {.name = "hot-out",       .has_arg = required_argument, .flag = 0, .val = 'o'},
     {0,0,0,0},
 };
-static char short_options[] = "x:";
+static char short_options[] = "x:c:t:yH:o:";
 
 void usage() {
-    fprintf(stderr, "Usage: cmr-mergebucket [-x <delimiter] <glob> [<glob ...]\n");
+    fprintf(stderr, "Usage: cmr-mergebucket [-x <delimiter] [--combine <aggregation-types>] [--threads <n>] [--binary] [--hot-keys <list> --hot-out <file>] <glob>[#<partition>] [<glob ...]\n");
 }
 
-#define BUFFER_SIZE 1024*64
+#define STREAM_BUFFER (1024*1024)
+#define OUT_BUFFER (4*1024*1024)
+#define MAX_THREADS 64
+#define SAMPLES_PER_RANGE 32
 
+// Regular files are mapped and their records sliced in place, anything else streams through a buffer
+// (compressed files too, decoded onto the end of it). Inputs can be text lines or cmb.h binary records,
+// a binary record is the line without its newline.
 typedef struct merge_state_t {
-    FILE* file;
+    int fd;         // -1 once the input runs dry
+    int view;       // slice of another input's map, nothing to release
+    char* rec;      // current record
     int rd;
+    int binary;     // -1 until a streamed input's first bytes are in
+    cmb_reader cmb;
+    int key_len;    // of a binary record
+    cmb_block* blocks; // index of a mapped binary input
+    int num_blocks; // -1 if it has none
+    char* map;
+    size_t map_len; // end of the mapped records
+    char* map_base; // the mapping itself, map is inside it for a partition (file#partition)
+    size_t map_base_len;
     char* buf;
+    size_t buf_size;
+    size_t buf_len;
+    size_t pos;     // next unread byte of map or buf
+    int eof;
+    cmz_decoder* cmz;
+    char* raw;
+    long long raw_left; // of a compressed partition, -1 for the rest of the file
     int skey_len;
+    int combinable; // has all the aggregate fields
+    unsigned long long prefix; // first 8 bytes of the key, big endian and zero padded
 } merge_state;
 
-char* next_key;
-int   next_skey_len;
+static char delimiter = '\002';
+static int binary_out = 0; // --binary, write cmb.h records instead of lines
+
+// Combining (--combine) folds each run of equal keys into one row, see combine.h
+static char agg_types[COMBINE_MAX_AGGS];
+static int num_aggs = 0;
+
+// One merge of a set of inputs into out, several run side by side with --threads
+typedef struct merger_t {
+    merge_state* inputs;
+    int num_inputs;
+    int* losers; // loser tree over the inputs, losers[0] holds the current winner
+
+    // Output is gathered into large blocks
+    int out;
+    char* obuf;
+    size_t olen;
+
+    cmb_writer bin;
+
+    agg_state* aggs;
+    char* group_key;
+    int group_len;
+    char* line;
+    size_t line_size;
+} merger;
 
 int null_stat (const char *path, struct stat *buf) {
     // For everyone's sake...
     return 0;
 }
 
+static void write_all(int out, const char* data, size_t len) {
+    while ( len > 0 ) {
+        ssize_t wr = write(out, data, len);
+        if ( wr < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            fprintf(stderr, "cmr-merge: write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        data += wr;
+        len -= wr;
+    }
+}
+
+static void out_flush(merger* mg) {
+    write_all(mg->out, mg->obuf, mg->olen);
+    mg->olen = 0;
+}
+
+static void out_write(merger* mg, const char* data, size_t len) {
+    if ( mg->olen + len > OUT_BUFFER ) { out_flush(mg); }
+    if ( len > OUT_BUFFER ) {
+        write_all(mg->out, data, len);
+        return;
+    }
+    memcpy(&mg->obuf[mg->olen], data, len);
+    mg->olen += len;
+}
+
+static void bin_sink(void* arg, const char* data, size_t len) {
+    out_write((merger*)arg, data, len);
+}
+
+// Write a text line in the output format
+static void out_line(merger* mg, const char* line, size_t len) {
+    if ( !binary_out ) {
+        out_write(mg, line, len);
+        return;
+    }
+    if ( len > 0 && line[len-1] == '\n' ) { len--; }
+    char* end = (char*)memchr(line, delimiter, len);
+    size_t key_len = end ? end - line : len;
+    cmb_add(&mg->bin, line, key_len, line + key_len, len - key_len);
+}
+
+// Write the current record of m in the output format
+static void out_record(merger* mg, merge_state* m) {
+    if ( !m->binary ) {
+        out_line(mg, m->rec, m->rd);
+    } else if ( binary_out ) {
+        cmb_add(&mg->bin, m->rec, m->key_len, m->rec + m->key_len, m->rd - m->key_len);
+    } else {
+        out_write(mg, m->rec, m->rd);
+        out_write(mg, "\n", 1);
+    }
+}
+
+// Find the key of the line just read, everything up to the delimiter (or up to the aggregate fields when combining)
+static void set_key(merge_state* m) {
+    char* end = &m->rec[m->rd];
+    if ( m->rd > 0 && end[-1] == '\n' ) { end--; }
+
+    char* pos;
+    if ( num_aggs > 0 ) {
+        pos = (char*)combine_key_end(m->rec, end, num_aggs);
+        m->combinable = pos != NULL;
+        if ( !pos ) { pos = end; } // short line, passes through as is
+    } else if ( m->binary ) {
+        pos = m->rec + m->key_len;
+    } else {
+        pos = (char*)memchr(m->rec, delimiter, m->rd);
+        if ( !pos ) { pos = end; }
+    }
+    m->skey_len = pos - m->rec;
+
+    m->prefix = 0;
+    for ( int i=0; i<8; i++ ) {
+        m->prefix <<= 8;
+        if ( i < m->skey_len ) { m->prefix |= (unsigned char)m->rec[i]; }
+    }
+}
+
+// Keys order bytewise, a key before its extensions
+static int key_cmp(const char* a, int a_len, const char* b, int b_len) {
+    int result = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if ( result != 0 ) { return result; }
+    return a_len - b_len;
+}
+
+// Empty files (and partitions) are skipped, part is -1 for the whole file
+static int open_input(merge_state* m, const char* path, int part) {
+    m->fd = open(path, O_RDONLY);
+    if ( m->fd < 0 ) { return -1; }
+
+    struct stat st;
+    off_t offset = 0;
+    off_t length = 0;
+    int regular = fstat(m->fd, &st) == 0 && S_ISREG(st.st_mode);
+    if ( regular ) { length = st.st_size; }
+    if ( part >= 0 && partfile_range(m->fd, part, &offset, &length) < 0 ) {
+        fprintf(stderr, "cmr-merge: %s has no partition %d\n", path, part);
+        exit(1);
+    }
+
+    if ( regular ) {
+        if ( length == 0 ) {
+            close(m->fd);
+            return -1;
+        }
+
+        char magic[4];
+        m->raw_left = part >= 0 ? length : -1;
+        if ( pread(m->fd, magic, sizeof(magic), offset) == sizeof(magic) && length >= sizeof(magic) && cmz_is_compressed(magic, sizeof(magic)) ) {
+            m->cmz = (cmz_decoder*)calloc(1, sizeof(cmz_decoder));
+            m->raw = (char*)malloc(STREAM_BUFFER);
+            m->buf_size = STREAM_BUFFER;
+            m->buf = (char*)malloc(m->buf_size);
+            m->binary = -1;
+            lseek(m->fd, offset, SEEK_SET);
+            posix_fadvise(m->fd, offset, part >= 0 ? length : 0, POSIX_FADV_SEQUENTIAL);
+            return 0;
+        }
+
+        // Mappings start on a page, a partition starts wherever it starts
+        off_t delta = offset % sysconf(_SC_PAGESIZE);
+        m->map_base_len = length + delta;
+        m->map_base = (char*)mmap(NULL, m->map_base_len, PROT_READ, MAP_PRIVATE, m->fd, offset - delta);
+        if ( m->map_base != MAP_FAILED ) {
+            m->map = m->map_base + delta;
+            m->map_len = length;
+            madvise(m->map_base, m->map_base_len, MADV_SEQUENTIAL);
+            m->binary = cmb_is_binary(m->map, m->map_len);
+            if ( m->binary ) { m->num_blocks = cmb_load_index(m->map, m->map_len, &m->blocks); }
+            return 0;
+        }
+        m->map_base = NULL;
+    }
+
+    m->binary = -1;
+
+    m->buf_size = STREAM_BUFFER;
+    m->buf = (char*)malloc(m->buf_size);
+    return 0;
+}
+
+static void close_input(merge_state* m) {
+    if ( !m->view ) {
+        if ( m->map_base ) { munmap(m->map_base, m->map_base_len); }
+        free(m->blocks);
+        if ( m->cmz ) {
+            cmz_decode_end(m->cmz);
+            free(m->cmz);
+            free(m->raw);
+        }
+        free(m->buf);
+        close(m->fd);
+    }
+    m->fd = -1;
+}
+
+static void buf_sink(void* arg, const char* data, size_t len) {
+    merge_state* m = (merge_state*)arg;
+    if ( m->buf_len + len > m->buf_size ) {
+        while ( m->buf_len + len > m->buf_size ) { m->buf_size *= 2; }
+        m->buf = (char*)realloc(m->buf, m->buf_size);
+    }
+    memcpy(&m->buf[m->buf_len], data, len);
+    m->buf_len += len;
+}
+
+// Decode more of a compressed input onto the end of the stream buffer, returns 0 once it's all read
+static ssize_t read_compressed(merge_state* m) {
+    size_t before = m->buf_len;
+    while ( m->buf_len == before ) {
+        size_t want = m->raw_left >= 0 && m->raw_left < STREAM_BUFFER ? m->raw_left : STREAM_BUFFER;
+        ssize_t rd = want > 0 ? read(m->fd, m->raw, want) : 0;
+        if ( rd < 0 && errno == EINTR ) { continue; }
+        if ( rd < 0 ) {
+            fprintf(stderr, "cmr-merge: read failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        if ( ( rd == 0 && cmz_decode_end(m->cmz) < 0 ) || cmz_decode(m->cmz, m->raw, rd, buf_sink, m) < 0 ) {
+            fprintf(stderr, "cmr-merge: corrupt compressed input\n");
+            exit(1);
+        }
+        if ( rd == 0 ) { return 0; }
+        if ( m->raw_left >= 0 ) { m->raw_left -= rd; }
+    }
+    return m->buf_len - before;
+}
+
+static void binary_record(merge_state* m, const cmb_record* rec) {
+    m->rec = (char*)rec->key;
+    m->key_len = rec->key_len;
+    m->rd = rec->key_len + rec->rest_len;
+}
+
+static void corrupt_input() {
+    fprintf(stderr, "cmr-merge: corrupt binary input\n");
+    exit(1);
+}
+
+// Slice the next record out of the stream buffer, refilling it (and growing it for long lines) as needed
+static int next_buffered(merge_state* m) {
+    while (1) {
+        char* start = &m->buf[m->pos];
+        if ( m->binary < 0 && ( m->buf_len - m->pos >= 4 || m->eof ) ) {
+            m->binary = cmb_is_binary(start, m->buf_len - m->pos);
+        }
+
+        if ( m->binary > 0 ) {
+            size_t used;
+            cmb_record rec;
+            int rc = cmb_next(&m->cmb, start, m->buf_len - m->pos, &used, &rec);
+            m->pos += used;
+            if ( rc == CMB_RECORD ) {
+                binary_record(m, &rec);
+                return 1;
+            }
+            if ( rc == CMB_ERROR || ( m->eof && ( m->pos < m->buf_len || !cmb_at_end(&m->cmb) ) ) ) { corrupt_input(); }
+            if ( m->eof ) { return 0; }
+            start = &m->buf[m->pos];
+        } else if ( m->binary == 0 ) {
+            char* nl = (char*)memchr(start, '\n', m->buf_len - m->pos);
+            if ( nl || ( m->eof && m->pos < m->buf_len ) ) {
+                m->rec = start;
+                m->rd = nl ? nl + 1 - start : m->buf_len - m->pos;
+                m->pos += m->rd;
+                return 1;
+            }
+            if ( m->eof ) { return 0; }
+        }
+
+        // Only part of a record left, move it up front and read in behind it
+        memmove(m->buf, start, m->buf_len - m->pos);
+        m->buf_len -= m->pos;
+        m->pos = 0;
+        if ( m->buf_len == m->buf_size ) {
+            m->buf_size *= 2;
+            m->buf = (char*)realloc(m->buf, m->buf_size);
+        }
+
+        if ( m->cmz ) {
+            if ( read_compressed(m) == 0 ) { m->eof = 1; }
+            continue;
+        }
+
+        ssize_t rd = read(m->fd, &m->buf[m->buf_len], m->buf_size - m->buf_len);
+        if ( rd < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            fprintf(stderr, "cmr-merge: read failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        if ( rd == 0 ) { m->eof = 1; }
+        m->buf_len += rd;
+    }
+}
+
+// Point m at the mapped line starting at pos
+static void map_record(merge_state* m, size_t pos) {
+    m->rec = &m->map[pos];
+    char* nl = (char*)memchr(m->rec, '\n', m->map_len - pos);
+    m->rd = nl ? nl + 1 - m->rec : m->map_len - pos;
+    m->pos = pos + m->rd;
+}
+
+// Next binary record of a map, a view can stop anywhere between records
+static int next_mapped_binary(merge_state* m) {
+    size_t used;
+    cmb_record rec;
+    int rc = cmb_next(&m->cmb, &m->map[m->pos], m->map_len - m->pos, &used, &rec);
+    m->pos += used;
+    if ( rc == CMB_RECORD ) {
+        binary_record(m, &rec);
+        return 1;
+    }
+    if ( rc == CMB_ERROR || ( !m->view && !cmb_at_end(&m->cmb) ) ) { corrupt_input(); }
+    return 0;
+}
+
+// Next line of input i, closes it once it runs dry
+static void advance(merger* mg, int i) {
+    merge_state* m = &mg->inputs[i];
+    if ( m->map ) {
+        if ( m->pos >= m->map_len ) {
+            close_input(m);
+            return;
+        }
+        if ( !m->binary ) {
+            map_record(m, m->pos);
+        } else if ( !next_mapped_binary(m) ) {
+            close_input(m);
+            return;
+        }
+    } else if ( !next_buffered(m) ) {
+        close_input(m);
+        return;
+    }
+    set_key(m);
+}
+
+// Does input a go out before input b? Ties go to the lower input
+static int beats(merger* mg, int a, int b) {
+    merge_state* ma = &mg->inputs[a];
+    merge_state* mb = &mg->inputs[b];
+    if ( ma->fd < 0 ) { return 0; }
+    if ( mb->fd < 0 ) { return 1; }
+    if ( ma->prefix != mb->prefix ) { return ma->prefix < mb->prefix; }
+
+    int result = key_cmp(ma->rec, ma->skey_len, mb->rec, mb->skey_len);
+    if ( result != 0 ) { return result < 0; }
+    return a < b;
+}
+
+// Play the subtree under node, leaving losers behind and returning the winner
+static int build(merger* mg, int node) {
+    if ( node >= mg->num_inputs ) { return node - mg->num_inputs; }
+    int l = build(mg, 2*node);
+    int r = build(mg, 2*node+1);
+    if ( beats(mg, l, r) ) {
+        mg->losers[node] = r;
+        return l;
+    }
+    mg->losers[node] = l;
+    return r;
+}
+
+// The winner's input moved on, replay its path to the root
+static void replay(merger* mg) {
+    int winner = mg->losers[0];
+    for ( int node = (winner + mg->num_inputs) / 2; node > 0; node /= 2 ) {
+        if ( beats(mg, mg->losers[node], winner) ) {
+            int t = mg->losers[node];
+            mg->losers[node] = winner;
+            winner = t;
+        }
+    }
+    mg->losers[0] = winner;
+}
+
+static void line_reserve(merger* mg, size_t len) {
+    if ( len > mg->line_size ) {
+        mg->line_size = len * 2;
+        mg->line = (char*)realloc(mg->line, mg->line_size);
+    }
+}
+
+// --hot-keys: rows whose key (up to the delimiter) is in a cmr-bucket .hot listing go to the --hot-out file as text
+// lines instead of the output, so the rows of a key salted over several buckets can be combined on their own.
+// The merge runs on one thread, and the file comes out in key order like the output.
+typedef struct hot_entry_t {
+    char* key;
+    int len;
+} hot_entry;
+
+static hot_entry* hot_list = NULL;
+static int num_hot = 0;
+static const char* hot_path = NULL;
+static FILE* hot_out = NULL;
+
+static int hot_cmp(const void* a, const void* b) {
+    const hot_entry* ha = (const hot_entry*)a;
+    const hot_entry* hb = (const hot_entry*)b;
+    if ( ha->len != hb->len ) { return ha->len < hb->len ? -1 : 1; }
+    return memcmp(ha->key, hb->key, ha->len);
+}
+
+// Lines are "<partition> <fanout> <key>"
+static void load_hot_keys(const char* path) {
+    FILE* f = fopen(path, "r");
+    if ( !f ) {
+        fprintf(stderr, "cmr-merge: can't read hot keys %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t rd;
+    while ( ( rd = getline(&line, &size, f) ) > 0 ) {
+        if ( line[rd-1] == '\n' ) { rd--; }
+        char* key = memchr(line, ' ', rd);
+        key = key ? memchr(key+1, ' ', rd - (key+1 - line)) : NULL;
+        if ( !key ) { continue; }
+        key++;
+        hot_list = (hot_entry*)realloc(hot_list, (num_hot+1) * sizeof(hot_entry));
+        hot_list[num_hot].len = rd - (key - line);
+        hot_list[num_hot].key = (char*)malloc(hot_list[num_hot].len + 1);
+        memcpy(hot_list[num_hot].key, key, hot_list[num_hot].len);
+        num_hot++;
+    }
+    free(line);
+    fclose(f);
+    qsort(hot_list, num_hot, sizeof(hot_entry), hot_cmp);
+}
+
+static int is_hot(const char* key, int len) {
+    hot_entry k = { .key = (char*)key, .len = len };
+    return bsearch(&k, hot_list, num_hot, sizeof(hot_entry), hot_cmp) != NULL;
+}
+
+// Is a text line's key hot?
+static int line_hot(const char* line, size_t len) {
+    if ( num_hot == 0 ) { return 0; }
+    if ( len > 0 && line[len-1] == '\n' ) { len--; }
+    const char* end = (const char*)memchr(line, delimiter, len);
+    return is_hot(line, end ? end - line : len);
+}
+
+static void hot_write(const char* data, size_t len) {
+    if ( !hot_out ) {
+        hot_out = fopen(hot_path, "w");
+        if ( !hot_out ) {
+            fprintf(stderr, "cmr-merge: can't open %s: %s\n", hot_path, strerror(errno));
+            exit(1);
+        }
+    }
+    if ( fwrite(data, 1, len, hot_out) != len ) {
+        fprintf(stderr, "cmr-merge: write failed: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// Write the current record of m to the output, or to the hot rows
+static void pass_record(merger* mg, merge_state* m) {
+    int hot = num_hot > 0 && ( m->binary ? is_hot(m->rec, m->key_len) : line_hot(m->rec, m->rd) );
+    if ( !hot ) {
+        out_record(mg, m);
+        return;
+    }
+    hot_write(m->rec, m->rd);
+    if ( m->binary || m->rd == 0 || m->rec[m->rd-1] != '\n' ) { hot_write("\n", 1); }
+}
+
+// Write out the row for the current group
+static void emit_group(merger* mg) {
+    if ( mg->group_len < 0 ) { return; }
+
+    line_reserve(mg, combine_row_size(agg_types, num_aggs, mg->aggs, mg->group_len));
+    size_t len = combine_row(mg->line, mg->group_key, mg->group_len, agg_types, num_aggs, mg->aggs);
+    if ( line_hot(mg->line, len) ) {
+        hot_write(mg->line, len);
+    } else {
+        out_line(mg, mg->line, len);
+    }
+    mg->group_len = -1;
+}
+
+static char* keep_text(char* old, int old_len, int len) {
+    return (char*)realloc(old, len + 1);
+}
+
+// Fold the aggregate fields of m into the current group, starting a new group if first
+static void fold(merger* mg, merge_state* m, int first) {
+    if ( first ) {
+        mg->group_key = (char*)realloc(mg->group_key, m->skey_len + 1);
+        memcpy(mg->group_key, m->rec, m->skey_len);
+        mg->group_len = m->skey_len;
+    }
+
+    char* end = &m->rec[m->rd];
+    if ( m->rd > 0 && end[-1] == '\n' ) { end--; }
+    combine_fold(agg_types, num_aggs, mg->aggs, &m->rec[m->skey_len], end, first, keep_text);
+}
+
+// Merge everything in mg->inputs to mg->out
+static void run_merge(merger* mg) {
+    if ( mg->num_inputs == 0 ) { return; }
+
+    mg->obuf = (char*)malloc(OUT_BUFFER);
+    mg->olen = 0;
+    mg->group_len = -1;
+    if ( binary_out ) { cmb_begin(&mg->bin, bin_sink, mg); }
+    if ( num_aggs > 0 ) {
+        mg->aggs = (agg_state*)calloc(num_aggs, sizeof(agg_state));
+    }
+
+    // Fill buffers
+    for ( int i=0; i<mg->num_inputs; i++ ) {
+        advance(mg, i);
+    }
+
+    mg->losers = (int*)calloc(mg->num_inputs+1, sizeof(int));
+    mg->losers[0] = mg->num_inputs > 1 ? build(mg, 1) : 0;
+
+    // Keys come out in order, equal keys drained input by input
+    while ( mg->inputs[mg->losers[0]].fd >= 0 ) {
+        merge_state* next = &mg->inputs[mg->losers[0]];
+        if ( num_aggs == 0 ) {
+            pass_record(mg, next);
+        } else if ( !next->combinable ) {
+            emit_group(mg);
+            pass_record(mg, next);
+        } else if ( mg->group_len == next->skey_len && memcmp(mg->group_key, next->rec, mg->group_len) == 0 ) {
+            fold(mg, next, 0);
+        } else {
+            emit_group(mg);
+            fold(mg, next, 1);
+        }
+        advance(mg, mg->losers[0]);
+        replay(mg);
+    }
+    emit_group(mg);
+    if ( binary_out ) { cmb_end(&mg->bin); }
+    out_flush(mg);
+}
+
+
+// Parallel merge (--threads): splitter keys sampled from the mapped inputs cut every input into the same
+// key ranges, each range is merged on its own thread and the outputs are put together in range order.
+// Equal keys always land in the same range, so the result is the same as a single merge.
+
+typedef struct sample_t {
+    const char* key;
+    int len;
+    double weight; // bytes of input it stands for
+} sample;
+
+static int sample_cmp(const void* a, const void* b) {
+    const sample* sa = (const sample*)a;
+    const sample* sb = (const sample*)b;
+    return key_cmp(sa->key, sa->len, sb->key, sb->len);
+}
+
+// First line start at or after pos
+static size_t line_start(merge_state* m, size_t pos) {
+    if ( pos == 0 ) { return 0; }
+    char* nl = (char*)memchr(&m->map[pos-1], '\n', m->map_len - (pos-1));
+    return nl ? nl + 1 - m->map : m->map_len;
+}
+
+// Key of the line starting at pos
+static void key_at(merge_state* m, size_t pos, const char** key, int* len) {
+    merge_state tmp = *m;
+    map_record(&tmp, pos);
+    set_key(&tmp);
+    *key = tmp.rec;
+    *len = tmp.skey_len;
+}
+
+// First line in [lo, map_len) whose key is not below the splitter, lo must be a line start
+static size_t lower_bound(merge_state* m, size_t lo, const sample* splitter) {
+    size_t hi = m->map_len;
+    while ( lo < hi ) {
+        size_t mid = line_start(m, lo + (hi - lo) / 2);
+        if ( mid >= hi ) { mid = lo; }
+
+        const char* key;
+        int len;
+        key_at(m, mid, &key, &len);
+        if ( key_cmp(key, len, splitter->key, splitter->len) < 0 ) {
+            lo = line_start(m, mid + 1);
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Binary inputs are cut through their block index. Keys compare the same way as for text, so with --combine the
+// first record of a block is read for its key rather than taking the indexed one.
+static void block_key(merge_state* m, int b, const char** key, int* len) {
+    if ( num_aggs == 0 ) {
+        *key = m->blocks[b].key;
+        *len = m->blocks[b].key_len;
+        return;
+    }
+    merge_state tmp = *m;
+    tmp.cmb.state = CMB_IN_BLOCK;
+    tmp.cmb.left = m->blocks[b].end - m->blocks[b].offset - 4;
+    tmp.pos = m->blocks[b].offset + 4;
+    tmp.view = 1;
+    next_mapped_binary(&tmp);
+    set_key(&tmp);
+    *key = tmp.rec;
+    *len = tmp.skey_len;
+}
+
+// First record in [lo, map_len) whose key is not below the splitter, lo must be a record start
+static size_t lower_bound_binary(merge_state* m, size_t lo, const sample* splitter) {
+    // Every block before the first one starting at or above the splitter is below it
+    int l = 0;
+    int h = m->num_blocks;
+    while ( l < h ) {
+        int mid = l + (h - l) / 2;
+        const char* key;
+        int len;
+        block_key(m, mid, &key, &len);
+        if ( key_cmp(key, len, splitter->key, splitter->len) < 0 ) {
+            l = mid + 1;
+        } else {
+            h = mid;
+        }
+    }
+
+    size_t pos = l < m->num_blocks ? m->blocks[l].offset + 4 : m->map_len;
+    if ( l > 0 ) {
+        // The answer may be inside the block before
+        merge_state tmp = *m;
+        cmb_block* b = &m->blocks[l-1];
+        tmp.cmb.state = CMB_IN_BLOCK;
+        tmp.cmb.left = b->end - b->offset - 4;
+        tmp.pos = b->offset + 4;
+        tmp.map_len = b->end;
+        tmp.view = 1;
+        while ( tmp.pos < tmp.map_len ) {
+            size_t at = tmp.pos;
+            next_mapped_binary(&tmp);
+            set_key(&tmp);
+            if ( key_cmp(tmp.rec, tmp.skey_len, splitter->key, splitter->len) >= 0 ) {
+                pos = at;
+                break;
+            }
+        }
+    }
+    return pos > lo ? pos : lo;
+}
+
+// Where a view of a binary input starting at a record is in its block
+static void view_binary(merge_state* v, merge_state* m) {
+    if ( v->pos == 0 ) { return; }
+    int l = 0;
+    int h = m->num_blocks - 1;
+    while ( l < h ) {
+        int mid = l + (h - l + 1) / 2;
+        if ( m->blocks[mid].offset < v->pos ) {
+            l = mid;
+        } else {
+            h = mid - 1;
+        }
+    }
+    v->cmb.state = CMB_IN_BLOCK;
+    v->cmb.left = m->blocks[l].end - v->pos;
+}
+
+static void* merge_main(void* arg) {
+    run_merge((merger*)arg);
+    return NULL;
+}
+
+// An unlinked file to hold a range's output until its turn
+static int spill_file() {
+    const char* dir = getenv("TMPDIR");
+    if ( !dir || !*dir ) { dir = "/tmp"; }
+
+    int fd = open(dir, O_TMPFILE|O_RDWR, S_IRUSR|S_IWUSR);
+    if ( fd >= 0 ) { return fd; }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/cmr-merge-XXXXXX", dir);
+    fd = mkstemp(path);
+    if ( fd >= 0 ) { unlink(path); }
+    return fd;
+}
+
+static void append_spill(int out, int fd) {
+    off_t len = lseek(fd, 0, SEEK_END);
+    off_t off = 0;
+    while ( off < len ) {
+        ssize_t n = sendfile(out, fd, &off, len - off);
+        if ( n < 0 && errno == EINTR ) { continue; }
+        if ( n <= 0 ) { break; }
+    }
+    if ( off == len ) { return; }
+
+    // sendfile refused, copy it through user space
+    char* buf = (char*)malloc(OUT_BUFFER);
+    ssize_t rd;
+    while ( ( rd = pread(fd, buf, OUT_BUFFER, off) ) > 0 ) {
+        write_all(out, buf, rd);
+        off += rd;
+    }
+    free(buf);
+}
+
+static void parallel_merge(merge_state* inputs, int num_inputs, int threads, int out) {
+    // Sample keys evenly through each input, weighted by the bytes between samples
+    int per_input = SAMPLES_PER_RANGE * threads;
+    sample* samples = (sample*)malloc((size_t)num_inputs * per_input * sizeof(sample));
+    int num_samples = 0;
+    double total = 0;
+    for ( int i=0; i<num_inputs; i++ ) {
+        merge_state* m = &inputs[i];
+        if ( m->binary ) {
+            int n = m->num_blocks < per_input ? m->num_blocks : per_input;
+            for ( int j=0; j<n; j++ ) {
+                sample* s = &samples[num_samples++];
+                block_key(m, (long long)m->num_blocks * j / n, &s->key, &s->len);
+                s->weight = (double)m->map_len / n;
+                total += s->weight;
+            }
+            continue;
+        }
+        for ( int j=0; j<per_input; j++ ) {
+            size_t pos = line_start(m, m->map_len / per_input * j);
+            if ( pos >= m->map_len ) { break; }
+            sample* s = &samples[num_samples++];
+            key_at(m, pos, &s->key, &s->len);
+            s->weight = (double)m->map_len / per_input;
+            total += s->weight;
+        }
+    }
+    qsort(samples, num_samples, sizeof(sample), sample_cmp);
+
+    sample splitters[MAX_THREADS];
+    int num_splitters = 0;
+    double seen = 0;
+    for ( int j=0; j<num_samples && num_splitters < threads-1; j++ ) {
+        seen += samples[j].weight;
+        if ( seen >= total * (num_splitters+1) / threads ) {
+            splitters[num_splitters++] = samples[j];
+        }
+    }
+    int ranges = num_splitters + 1;
+
+    // Cut every input at the splitters
+    size_t* bounds = (size_t*)malloc((size_t)num_inputs * (ranges+1) * sizeof(size_t));
+    for ( int i=0; i<num_inputs; i++ ) {
+        size_t* b = &bounds[i * (ranges+1)];
+        b[0] = 0;
+        for ( int k=0; k<num_splitters; k++ ) {
+            b[k+1] = inputs[i].binary ? lower_bound_binary(&inputs[i], b[k], &splitters[k]) : lower_bound(&inputs[i], b[k], &splitters[k]);
+        }
+        b[ranges] = inputs[i].map_len;
+    }
+
+    merger* mergers = (merger*)calloc(ranges, sizeof(merger));
+    pthread_t workers[MAX_THREADS];
+    for ( int k=0; k<ranges; k++ ) {
+        merger* mg = &mergers[k];
+        mg->inputs = (merge_state*)calloc(num_inputs+1, sizeof(merge_state));
+        for ( int i=0; i<num_inputs; i++ ) {
+            size_t* b = &bounds[i * (ranges+1)];
+            if ( b[k] == b[k+1] ) { continue; }
+            merge_state* m = &mg->inputs[mg->num_inputs++];
+            m->fd = inputs[i].fd;
+            m->view = 1;
+            m->map = inputs[i].map;
+            m->pos = b[k];
+            m->map_len = b[k+1];
+            m->binary = inputs[i].binary;
+            if ( m->binary ) { view_binary(m, &inputs[i]); }
+        }
+
+        // The first range goes straight out, the rest wait their turn in spill files
+        mg->out = k == 0 ? out : spill_file();
+        if ( mg->out < 0 ) {
+            fprintf(stderr, "cmr-merge: no spill file: %s\n", strerror(errno));
+            exit(1);
+        }
+        pthread_create(&workers[k], NULL, merge_main, mg);
+    }
+
+    for ( int k=0; k<ranges; k++ ) {
+        pthread_join(workers[k], NULL);
+        if ( k > 0 ) {
+            append_spill(out, mergers[k].out);
+            close(mergers[k].out);
+        }
+    }
+}
+
 
 int main( int argc, char* const argv[] ) {
     int option_index = 0;
     glob_t file_glob;
-    char delimiter = '\002';
 
     file_glob.gl_stat = null_stat;
     file_glob.gl_lstat = null_stat;
@@ -63,21 +885,37 @@ int main( int argc, char* const argv[] ) {
     file_glob.gl_readdir = (struct dirent* (*)(void*))readdir;
     file_glob.gl_closedir = (void (*)(void*))closedir;
 
-    char *pattern;
     int num_files = 0;
-    int open_files = 0;
-    size_t buffer_size = BUFFER_SIZE;
-    char* pos;
+    int threads = 1;
     int argi = 1;
 
     while (1) {
         int opt = getopt_long(argc, argv, short_options, long_options, &option_index);
         if (opt < 0) { break; }
         switch (opt) {
-            case 'x': // buffer-size
+            case 'x': // delimiter
                 argi += 2;
                 delimiter = optarg[0];
-                buffer_size = atoi(optarg);
+                break;
+            case 'c': // combine
+                argi += 2;
+                num_aggs = combine_parse(optarg, agg_types);
+                break;
+            case 't': // threads
+                argi += 2;
+                threads = atoi(optarg);
+                break;
+            case 'y': // binary
+                argi++;
+                binary_out = 1;
+                break;
+            case 'H': // hot-keys
+                argi += 2;
+                load_hot_keys(optarg);
+                break;
+            case 'o': // hot-out
+                argi += 2;
+                hot_path = optarg;
                 break;
         }
     }
@@ -86,94 +924,50 @@ int main( int argc, char* const argv[] ) {
         usage();
         exit(1);
     }
+    if ( threads < 1 ) { threads = 1; }
+    if ( threads > MAX_THREADS ) { threads = MAX_THREADS; }
+    if ( !hot_path ) { num_hot = 0; }
+    if ( num_hot > 0 ) { threads = 1; }
 
-    glob(argv[argi++], GLOB_ALTDIRFUNC|GLOB_BRACE, NULL, &file_glob);
-
+    // A glob can name the same partition of every file it matches as <glob>#partition
+    int* parts = NULL;
+    int glob_flags = GLOB_ALTDIRFUNC|GLOB_BRACE;
     for ( int i=argi; i<argc; i++ ) {
-        glob(argv[i], GLOB_ALTDIRFUNC|GLOB_BRACE|GLOB_APPEND, NULL, &file_glob);
+        int part = partfile_split(argv[i]);
+        glob(argv[i], glob_flags, NULL, &file_glob);
+        parts = (int*)realloc(parts, (file_glob.gl_pathc+1) * sizeof(int));
+        for ( ; num_files < file_glob.gl_pathc; num_files++ ) {
+            parts[num_files] = part;
+        }
+        glob_flags |= GLOB_APPEND;
     }
 
-    num_files = file_glob.gl_pathc;
-
-    merge_state* mergy = (merge_state*)calloc(1, num_files*sizeof(merge_state));
-    merge_state* next = &mergy[0];
+    merger mg = {0};
+    mg.inputs = (merge_state*)calloc(num_files+1, sizeof(merge_state));
+    mg.out = fileno(stdout);
 
     // The great opening
+    int mapped = 1;
     for ( int i=0; i<num_files; i++ ) {
-        mergy[open_files].file = fopen( file_glob.gl_pathv[i], "rb" );
-        if ( mergy[open_files].file ) {
-            mergy[open_files].buf = (char*)malloc(buffer_size*sizeof(char));
-            open_files++;
+        if ( open_input(&mg.inputs[mg.num_inputs], file_glob.gl_pathv[i], parts[i]) == 0 ) {
+            merge_state* m = &mg.inputs[mg.num_inputs];
+            mapped = mapped && m->map && ( !m->binary || m->num_blocks >= 0 );
+            mg.num_inputs++;
         }
     }
 
-    if ( open_files == 0 ) {
+    if ( mg.num_inputs == 0 ) {
         exit(0);
     }
 
-    next_key = (char*)malloc(buffer_size*sizeof(char));
-    
-    // Fill buffers
-    for ( int i=0; i<num_files; i++ ) {
-        if ( !mergy[i].file ) { continue; }
-        if ( ( mergy[i].rd = getline(&mergy[i].buf, &buffer_size, mergy[i].file) ) <= 0 ) {
-            fclose(mergy[i].file);
-            mergy[i].file = NULL;
-            open_files--;
-            continue;
-        }
-        // Figure out how long the key is
-        pos = mergy[i].buf;
-        while (pos[0] != delimiter) { pos++; }
-        mergy[i].skey_len = pos - mergy[i].buf;
+    // Ranges need random access, streamed (or unindexed binary) inputs get a single merge
+    if ( threads > 1 && mapped ) {
+        parallel_merge(mg.inputs, mg.num_inputs, threads, mg.out);
+    } else {
+        run_merge(&mg);
     }
-    
-
-    int out = fileno(stdout);
-
-    while( open_files > 0 ) {
-        // Find a key...
-        for ( int i=0; i<num_files; i++ ) {
-            if (mergy[i].file) {
-                next = &mergy[i];
-                break;
-            }
-        }
-
-        // Find the next key...
-        for ( int i=0; i<num_files; i++ ) {
-            if ( !mergy[i].file ) { continue; }
-            int cmp_len = next->skey_len < mergy[i].skey_len ? next->skey_len : mergy[i].skey_len;
-            int result = memcmp(next->buf, mergy[i].buf, cmp_len);
-            //printf("%.*s <=> %.*s  ==  %d\n", next->skey_len, next->buf, mergy[i].skey_len, mergy[i].buf, result);
-            if ( result > 0 ) {
-                next = &mergy[i];
-            }
-        }
-
-        memcpy(next_key, next->buf, next->skey_len);
-        next_skey_len = next->skey_len;
-
-        // Output this key until there is... no more!
-        for ( int i=0; i<num_files; i++ ) {
-            if ( !mergy[i].file ) { continue; }
-            //printf("%s ... %.*s\n", next_key, next_skey_len, mergy[i].buf);
-            while ( next_skey_len == mergy[i].skey_len &&
-                    memcmp(next_key, mergy[i].buf, next_skey_len) == 0 ) {
-                write( out, mergy[i].buf, mergy[i].rd );
-                mergy[i].rd = getline(&mergy[i].buf, &buffer_size, mergy[i].file);
-                if ( mergy[i].rd <= 0 ) {
-                    // Failed to refill buffer (probably EOF)
-                    fclose(mergy[i].file);
-                    mergy[i].file = NULL; 
-                    open_files--;
-                    break;
-                }
-                // Figure out how long the key is
-                pos = mergy[i].buf;
-                while (pos[0] != delimiter) { pos++; }
-                mergy[i].skey_len = pos - mergy[i].buf;
-            }
-        }
+    if ( hot_out && fclose(hot_out) != 0 ) {
+        fprintf(stderr, "cmr-merge: write failed: %s\n", strerror(errno));
+        exit(1);
     }
 }
@@ -16,6 +16,11 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,16 +28,71 @@
 #include <string.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <zlib.h>
+
+#include "cmz.h"
+#include "cmb.h"
+#include "cmtext.h"
 
 #define MAX_PROCESSES 128
 #define MAX_ARGS 8192
+#define PIPE_SIZE (1024*1024) // 64KB pipes have the chunky stages handing over a 16MB write 64KB at a time
+
+// epoll data for the signalfd, stderr pipes are their process's index and relays MAX_PROCESSES+1 and up
+#define EV_SIGNALS MAX_PROCESSES
+#define EV_RELAY (MAX_PROCESSES+1)
+#define EV_BUILTINS (2*MAX_PROCESSES+1)
+
+#define BUILTIN_BLOCK (1024*1024)
+
+// --CMR_PARALLEL stages: unordered copies are dealt small blocks to keep them evenly busy, ordered ones get a
+// process per block so blocks should be big enough to be worth one
+#define MAX_COPIES 64
+#define PARALLEL_BLOCK (1024*1024)
+#define PARALLEL_ORDERED_BLOCK (16*1024*1024)
 
 // Because omg pipe magic is unreadable
 #define FD_STDIN 0
 #define FD_STDOUT 1
+#define FD_STDERR 2
 #define READ_END(x) x[0]
 #define WRITE_END(x) x[1]
 
+// Builtin stages run as threads of cmr-pipe, next to each other they pass data through one of these
+// instead of a pipe. One thread writes, one reads, head and tail only grow.
+typedef struct Ring_T {
+    char* data;
+    size_t size;
+    size_t head;
+    size_t tail;
+    int writer_done;
+    int reader_done;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Ring;
+
+// A builtin's input or output: a ring, or a pipe or file to a process
+typedef struct StageIO_T {
+    int fd;
+    Ring* ring;
+    long long bytes;
+} StageIO;
+
+struct ProcInfo_T;
+typedef int (*BuiltinMain)(struct ProcInfo_T* p);
+
 typedef struct ProcInfo_T {
     char* spawn_args[1024];
     char* name;
@@ -45,66 +105,1407 @@ typedef struct ProcInfo_T {
     int out_fd;
     int no_stdout;
     int no_stderr;
+    struct timespec started;
+    double wall;
+    struct rusage usage;
+    long long bytes_in;  // read by the process, -1 if unknown
+    long long bytes_out; // written by the process
+    int pipe_size;       // of the pipes out of the process
+    int relay_from;      // with --CMR_PIPE_RELAY, cmr-pipe moves the process's output on to the next
+    int relay_to;        // process itself, -1 once that's done
+    long long relayed;
+    int stalled;         // the next process's pipe was full with more waiting
+    struct timespec stalled_since;
+    double blocked;
+    BuiltinMain builtin; // NULL for a process
+    StageIO in;
+    StageIO out;
+    int done;            // set by a builtin's thread when it's through
+    int copies;          // with --CMR_PARALLEL, run by a thread of its own like a builtin
+    int ordered;
+    struct Fanout_T* fanout;
 } ProcInfo;
 
 int num_processes = 0;
 ProcInfo processes[MAX_PROCESSES];
 
+int builtins_fd;         // eventfd, a builtin finished
+int abort_builtins = 0;
+
+posix_spawnattr_t attr;
+
+// A --CMR_PARALLEL stage: its thread deals blocks of lines out to copies of the process, and a second
+// thread merges what they write
+enum { COPY_FREE = 0, COPY_RUNNING, COPY_WAITING };
+
+typedef struct Copy_T {
+    int state;       // COPY_WAITING: exited, its block's output waits its turn
+    pid_t pid;
+    int in_fd;       // written by the dealer
+    int out_fd;      // read by the merger, -1 at EOF
+    long long block; // ordered, the block it was given
+    char* pending;   // output not passed on yet: a partial line, or a block's output waiting its turn
+    size_t pending_len;
+    size_t pending_size;
+} Copy;
+
+typedef struct Fanout_T {
+    struct ProcInfo_T* p;
+    Copy copies[MAX_COPIES];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int wake_fd;          // eventfd, tells the merger a copy started or the dealing is over
+    int dealing_done;
+    int failed;           // stop dealing, a copy failed or the output is gone
+    long long merged;     // ordered, the next block to pass on
+    int status;           // the first failure of a copy, or else its first nonzero wait status
+    int rc;               // the merger's write failure
+    struct rusage usage;  // copies and merger
+} Fanout;
+
+size_t buffer_size = 65535;
+char* buf;
+
+void
+kill_all() {
+    for (int i=0; i<num_processes; i++) {
+        if ( !processes[i].finished && !processes[i].builtin ) {
+            kill( processes[i].pid, SIGKILL);
+        }
+        Fanout* f = processes[i].fanout;
+        if ( f && !processes[i].finished ) {
+            pthread_mutex_lock(&f->lock);
+            f->failed = 1;
+            for ( int c = 0; c < processes[i].copies; c++ ) {
+                if ( f->copies[c].state == COPY_RUNNING ) {
+                    kill(f->copies[c].pid, SIGKILL);
+                }
+            }
+            pthread_cond_broadcast(&f->changed);
+            pthread_mutex_unlock(&f->lock);
+        }
+    }
+    __atomic_store_n(&abort_builtins, 1, __ATOMIC_RELEASE);
+    for (int i=0; i<num_processes; i++) {
+        Ring* rings[2] = { processes[i].in.ring, processes[i].out.ring };
+        for (int k=0; k<2; k++) {
+            if ( rings[k] ) {
+                pthread_mutex_lock(&rings[k]->lock);
+                pthread_cond_broadcast(&rings[k]->changed);
+                pthread_mutex_unlock(&rings[k]->lock);
+            }
+        }
+    }
+}
+
 void 
-sigdeath(int signum) {
+sigdeath() {
+    kill_all();
     for (int i=0; i<num_processes; i++) {
-        kill( processes[i].pid, SIGKILL);
-        waitpid(processes[i].pid, &processes[i].status, 0);
-        close(processes[i].err_fd);
+        if ( !processes[i].finished && !processes[i].builtin ) {
+            waitpid(processes[i].pid, &processes[i].status, 0);
+        }
     }
     exit(1);
 }
 
+// A couple of strange exit codes that we'd rather not produce a failure on (we'll still get warnings in the logs)
+int
+tolerated_failure(ProcInfo* p, int status) {
+    if ( WEXITSTATUS(status) != 1 ) {
+        return 0;
+    }
+    if ( strcmp(p->spawn_args[0], "cat") == 0 || strcmp(p->spawn_args[0], "zcat") == 0 || strcmp(p->spawn_args[0], "grep") == 0 ) {
+        return 1;
+    }
+    if ( strcmp(p->spawn_args[0], "cmr:cat") == 0 || strcmp(p->spawn_args[0], "cmr:zcat") == 0 || strcmp(p->spawn_args[0], "cmr:grep") == 0 ) {
+        return 1;
+    }
+    if ( strcmp(p->spawn_args[0], "sh") == 0 && p->num_args > 2 ) {
+        if ( strncmp(p->spawn_args[2], "cat",  sizeof("cat")-1)  == 0 ||
+             strncmp(p->spawn_args[2], "zcat", sizeof("zcat")-1) == 0 ||
+             strncmp(p->spawn_args[2], "grep", sizeof("grep")-1) == 0 ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether a stage's wait status fails the pipeline. A stage killed by a signal has failed, unless it's SIGPIPE
+// and the stage isn't the last, a later stage having stopped reading early.
+int
+stage_failed(ProcInfo* p, int status) {
+    if ( WIFSIGNALED(status) ) {
+        return WTERMSIG(status) != SIGPIPE || p == &processes[num_processes-1];
+    }
+    return WEXITSTATUS(status) != 0 && !tolerated_failure(p, status);
+}
+
+double
+elapsed(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ( now.tv_sec - since->tv_sec ) + ( now.tv_nsec - since->tv_nsec ) / 1e9;
+}
+
+// Bytes an exited (not yet reaped) process read and wrote through system calls, files and pipes alike
+void
+read_io(ProcInfo* p) {
+    char path[64];
+    char line[256];
+    p->bytes_in = p->bytes_out = -1;
+    snprintf(path, sizeof(path), "/proc/%d/io", p->pid);
+    FILE* io = fopen(path, "r");
+    if ( !io ) {
+        return;
+    }
+    while ( fgets(line, sizeof(line), io) ) {
+        sscanf(line, "rchar: %lld", &p->bytes_in);
+        sscanf(line, "wchar: %lld", &p->bytes_out);
+    }
+    fclose(io);
+}
+
+// --CMR_PIPE_STATS: a line per process, its name then tab separated key=value pairs (times in seconds,
+// maxrss in KB, csw counts context switches, status is the exit code or minus the signal that killed it). With --CMR_PIPE_RELAY, relayed
+// is what it passed to the next process and blocked how long that sat with the next process's pipe full.
+void
+write_stats(FILE* stats) {
+    for ( int j = 0; j < num_processes; j++ ) {
+        ProcInfo* p = &processes[j];
+        fprintf(stats, "%s\twall=%.3f\tuser=%.3f\tsys=%.3f\tmaxrss=%ld\tcsw=%ld\tin=%lld\tout=%lld\tstatus=%d",
+            p->name, p->wall,
+            p->usage.ru_utime.tv_sec + p->usage.ru_utime.tv_usec / 1e6,
+            p->usage.ru_stime.tv_sec + p->usage.ru_stime.tv_usec / 1e6,
+            p->usage.ru_maxrss, p->usage.ru_nvcsw + p->usage.ru_nivcsw, p->bytes_in, p->bytes_out,
+            WIFSIGNALED(p->status) ? -WTERMSIG(p->status) : WEXITSTATUS(p->status));
+        if ( p->relayed >= 0 ) {
+            fprintf(stats, "\trelayed=%lld\tblocked=%.3f", p->relayed, p->blocked);
+        }
+        fprintf(stats, "\n");
+    }
+    fclose(stats);
+}
+
+// Pass on whatever a process has written to stderr, stops once the pipe is empty or closed
+void
+drain_stderr(int epfd, ProcInfo* p) {
+    ssize_t rd;
+    while ( p->err_read_fd >= 0 ) {
+        rd = read(p->err_read_fd, buf, buffer_size);
+        if ( rd < 0 && errno == EINTR ) { continue; }
+        if ( rd < 0 ) { return; }
+        if ( rd == 0 ) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, p->err_read_fd, NULL);
+            close(p->err_read_fd);
+            p->err_read_fd = -1;
+            return;
+        }
+        fprintf(stdout, "%s: %.*s", p->name, (int)rd, buf);
+    }
+}
+
+void
+end_relay(int epfd, ProcInfo* p) {
+    if ( p->stalled ) {
+        p->blocked += elapsed(&p->stalled_since);
+        p->stalled = 0;
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, p->relay_from, NULL);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, p->relay_to, NULL);
+    close(p->relay_from);
+    close(p->relay_to); // EOF for the next process
+    p->relay_from = p->relay_to = -1;
+}
+
+// Splice what a process has written on to the next one. When the next pipe fills with more waiting the relay
+// watches for room there instead, and the time until then counts as blocked.
+void
+relay(int epfd, ProcInfo* p, int writable) {
+    struct epoll_event ev = { .data.u32 = EV_RELAY + (p - processes) };
+    if ( p->relay_from < 0 ) {
+        return;
+    }
+    if ( writable && p->stalled ) {
+        p->blocked += elapsed(&p->stalled_since);
+        p->stalled = 0;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p->relay_to, NULL);
+        ev.events = EPOLLIN;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, p->relay_from, &ev);
+    }
+    while ( !p->stalled ) {
+        ssize_t n = splice(p->relay_from, NULL, p->relay_to, NULL, p->pipe_size, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if ( n > 0 ) {
+            p->relayed += n;
+            continue;
+        }
+        if ( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( n < 0 && errno == EAGAIN ) {
+            int waiting = 0;
+            if ( ioctl(p->relay_from, FIONREAD, &waiting) == 0 && waiting > 0 ) {
+                clock_gettime(CLOCK_MONOTONIC, &p->stalled_since);
+                p->stalled = 1;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, p->relay_from, NULL);
+                ev.events = EPOLLOUT;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, p->relay_to, &ev);
+            }
+            return;
+        }
+        // The process closed its output, or the next one is gone
+        end_relay(epfd, p);
+        return;
+    }
+}
+
+
+// Builtin stages
+//
+// cmr:cat, cmr:zcat and cmr:grep stand in for the input chunky, gzip -dc and a fixed string grep, cmr:write
+// for the output chunky. They run as threads here, so a pipeline of them costs no processes and, between
+// each other, no pipes. A process on either side of one still gets a pipe.
+
+Ring*
+ring_new(size_t size) {
+    Ring* r = (Ring*)calloc(1, sizeof(Ring));
+    r->data = (char*)malloc(size);
+    r->size = size;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->changed, NULL);
+    return r;
+}
+
+// Returns -1 once the reader is gone
+int
+ring_write(Ring* r, const char* data, size_t len) {
+    while ( len > 0 ) {
+        pthread_mutex_lock(&r->lock);
+        while ( r->head - r->tail == r->size && !r->reader_done && !__atomic_load_n(&abort_builtins, __ATOMIC_ACQUIRE) ) {
+            pthread_cond_wait(&r->changed, &r->lock);
+        }
+        if ( r->reader_done || __atomic_load_n(&abort_builtins, __ATOMIC_ACQUIRE) ) {
+            pthread_mutex_unlock(&r->lock);
+            errno = EPIPE;
+            return -1;
+        }
+        size_t head = r->head;
+        size_t room = r->size - (r->head - r->tail);
+        pthread_mutex_unlock(&r->lock);
+
+        // Only this thread touches the free part
+        size_t n = len < room ? len : room;
+        size_t at = head % r->size;
+        size_t first = n < r->size - at ? n : r->size - at;
+        memcpy(&r->data[at], data, first);
+        memcpy(r->data, data + first, n - first);
+
+        pthread_mutex_lock(&r->lock);
+        r->head += n;
+        pthread_cond_broadcast(&r->changed);
+        pthread_mutex_unlock(&r->lock);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns 0 at the end of the data, -1 if the pipeline is being torn down
+ssize_t
+ring_read(Ring* r, char* buf, size_t len) {
+    pthread_mutex_lock(&r->lock);
+    while ( r->head == r->tail && !r->writer_done && !__atomic_load_n(&abort_builtins, __ATOMIC_ACQUIRE) ) {
+        pthread_cond_wait(&r->changed, &r->lock);
+    }
+    if ( __atomic_load_n(&abort_builtins, __ATOMIC_ACQUIRE) ) {
+        pthread_mutex_unlock(&r->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    size_t tail = r->tail;
+    size_t avail = r->head - r->tail;
+    pthread_mutex_unlock(&r->lock);
+
+    size_t n = len < avail ? len : avail;
+    size_t at = tail % r->size;
+    size_t first = n < r->size - at ? n : r->size - at;
+    memcpy(buf, &r->data[at], first);
+    memcpy(buf + first, r->data, n - first);
+
+    pthread_mutex_lock(&r->lock);
+    r->tail += n;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+ssize_t
+io_read(StageIO* io, char* buf, size_t len) {
+    ssize_t rd;
+    if ( io->ring ) {
+        rd = ring_read(io->ring, buf, len);
+    } else {
+        while ( ( rd = read(io->fd, buf, len) ) < 0 && errno == EINTR );
+    }
+    if ( rd > 0 ) {
+        io->bytes += rd;
+    }
+    return rd;
+}
+
+int
+io_write(StageIO* io, const char* data, size_t len) {
+    io->bytes += len;
+    if ( io->ring ) {
+        return ring_write(io->ring, data, len);
+    }
+    while ( len > 0 ) {
+        ssize_t wr = write(io->fd, data, len);
+        if ( wr < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( wr < 0 ) {
+            return -1;
+        }
+        data += wr;
+        len -= wr;
+    }
+    return 0;
+}
+
+// Lets the other side know this side is done: EOF for a reader, EPIPE for a writer
+void
+io_close(StageIO* io, int writer) {
+    if ( io->ring ) {
+        pthread_mutex_lock(&io->ring->lock);
+        if ( writer ) {
+            io->ring->writer_done = 1;
+        } else {
+            io->ring->reader_done = 1;
+        }
+        pthread_cond_broadcast(&io->ring->changed);
+        pthread_mutex_unlock(&io->ring->lock);
+    } else if ( io->fd > FD_STDOUT ) {
+        close(io->fd);
+    }
+}
+
+// What a process would have put on stderr
+void
+builtin_error(ProcInfo* p, const char* fmt, ...) {
+    char msg[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    if ( p->no_stderr ) {
+        dprintf(p->err_fd, "%s\n", msg);
+    } else {
+        fprintf(stdout, "%s: %s\n", p->name, msg);
+    }
+}
+
+// A builtin whose reader went away ends as a process would, killed by SIGPIPE
+int
+write_failed(ProcInfo* p) {
+    if ( errno == EPIPE ) {
+        return -SIGPIPE;
+    }
+    builtin_error(p, "write failed: %s", strerror(errno));
+    return 2;
+}
+
+// Files named after the builtin or else its input, one at a time; returns -1 when there are no more
+int
+next_source(ProcInfo* p, int* arg, int* rc) {
+    if ( p->num_args == 1 ) {
+        return (*arg)++ == 0 ? -2 : -1; // -2: the stage's input
+    }
+    while ( ++(*arg) < p->num_args ) {
+        int fd = open(p->spawn_args[*arg], O_RDONLY|O_CLOEXEC);
+        if ( fd >= 0 ) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            return fd;
+        }
+        builtin_error(p, "%s: %s", p->spawn_args[*arg], strerror(errno));
+        *rc = 1;
+    }
+    return -1;
+}
+
+ssize_t
+source_read(ProcInfo* p, int fd, char* buf, size_t len) {
+    if ( fd == -2 ) {
+        return io_read(&p->in, buf, len);
+    }
+    ssize_t rd;
+    while ( ( rd = read(fd, buf, len) ) < 0 && errno == EINTR );
+    if ( rd > 0 ) {
+        p->in.bytes += rd;
+    }
+    return rd;
+}
+
+void
+source_close(int fd) {
+    if ( fd >= 0 ) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Small writes gathered into blocks
+typedef struct OutBuffer_T {
+    char* data;
+    size_t len;
+} OutBuffer;
+
+int
+out_add(ProcInfo* p, OutBuffer* o, const char* data, size_t len) {
+    if ( o->len + len > BUILTIN_BLOCK && o->len > 0 ) {
+        if ( io_write(&p->out, o->data, o->len) < 0 ) {
+            return -1;
+        }
+        o->len = 0;
+    }
+    if ( len > BUILTIN_BLOCK ) {
+        return io_write(&p->out, data, len);
+    }
+    if ( !o->data ) {
+        o->data = (char*)malloc(BUILTIN_BLOCK);
+    }
+    memcpy(&o->data[o->len], data, len);
+    o->len += len;
+    return 0;
+}
+
+int
+out_flush(ProcInfo* p, OutBuffer* o) {
+    int rc = o->len > 0 ? io_write(&p->out, o->data, o->len) : 0;
+    o->len = 0;
+    return rc;
+}
+
+// Like the input chunky, cmr:cat turns intermediate files (cmz.h, cmb.h) back into text lines
+typedef struct CatSink_T {
+    ProcInfo* p;
+    int rc;          // from write_failed
+    OutBuffer out;
+} CatSink;
+
+void
+cat_sink(void* arg, const char* data, size_t len) {
+    CatSink* c = (CatSink*)arg;
+    if ( c->rc == 0 && out_add(c->p, &c->out, data, len) < 0 ) {
+        c->rc = write_failed(c->p);
+    }
+}
+
+// The rest of a source whose first block, head, starts with an intermediate format's magic number
+int
+cat_decode(ProcInfo* p, int fd, const char* source, char* buf, ssize_t rd) {
+    CatSink c = { .p = p };
+    cmtext_decoder d;
+    cmtext_begin(&d, cmz_is_compressed(buf, rd), cat_sink, &c);
+    while ( cmtext_decode(&d, buf, rd) == 0 && c.rc == 0 && ( rd = source_read(p, fd, buf, BUILTIN_BLOCK) ) > 0 );
+
+    int rc = c.rc;
+    if ( rc == 0 && rd < 0 && errno != EPIPE ) {
+        builtin_error(p, "read failed: %s", strerror(errno));
+        rc = 2;
+    }
+    if ( cmtext_end(&d) < 0 && rc == 0 ) {
+        builtin_error(p, "%s: %s", source, d.error);
+        rc = 2;
+    }
+    if ( rc == 0 && ( c.rc != 0 || out_flush(p, &c.out) < 0 ) ) {
+        rc = c.rc != 0 ? c.rc : write_failed(p); // a last record may have failed to go out
+    }
+    free(c.out.data);
+    return rc;
+}
+
+// cmr:cat [file ...]
+int
+cat_main(ProcInfo* p) {
+    char* buf = (char*)malloc(BUILTIN_BLOCK);
+    int rc = 0;
+    int arg = 0;
+    int fd;
+    while ( rc >= 0 && rc < 2 && ( fd = next_source(p, &arg, &rc) ) != -1 ) {
+        const char* source = fd == -2 ? "input" : p->spawn_args[arg];
+        ssize_t rd = source_read(p, fd, buf, BUILTIN_BLOCK);
+        if ( rd > 0 && cmtext_is_encoded(buf, rd) ) {
+            int decoded = cat_decode(p, fd, source, buf, rd);
+            rc = decoded != 0 ? decoded : rc;
+            source_close(fd);
+            continue;
+        }
+        for ( ; rd > 0; rd = source_read(p, fd, buf, BUILTIN_BLOCK) ) {
+            if ( io_write(&p->out, buf, rd) < 0 ) {
+                rc = write_failed(p);
+                break;
+            }
+        }
+        if ( rd < 0 && errno != EPIPE ) {
+            builtin_error(p, "read failed: %s", strerror(errno));
+            rc = 2;
+        }
+        source_close(fd);
+    }
+    free(buf);
+    return rc;
+}
+
+// cmr:zcat [file ...], gzip (or zlib) streams, concatenated ones too
+int
+zcat_main(ProcInfo* p) {
+    char* raw = (char*)malloc(BUILTIN_BLOCK);
+    char* buf = (char*)malloc(BUILTIN_BLOCK);
+    int rc = 0;
+    int arg = 0;
+    int fd;
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    inflateInit2(&z, 15+32);
+
+    while ( rc >= 0 && rc < 2 && ( fd = next_source(p, &arg, &rc) ) != -1 ) {
+        const char* source = fd == -2 ? "input" : p->spawn_args[arg];
+        int in_stream = 0;
+        ssize_t rd;
+        inflateReset(&z);
+        while ( rc >= 0 && rc < 2 && ( rd = source_read(p, fd, raw, BUILTIN_BLOCK) ) > 0 ) {
+            z.next_in = (Bytef*)raw;
+            z.avail_in = rd;
+            while ( z.avail_in > 0 ) {
+                z.next_out = (Bytef*)buf;
+                z.avail_out = BUILTIN_BLOCK;
+                int zrc = inflate(&z, Z_NO_FLUSH);
+                in_stream = 1;
+                if ( zrc != Z_OK && zrc != Z_STREAM_END && zrc != Z_BUF_ERROR ) {
+                    builtin_error(p, "%s: corrupt gzip data", source);
+                    rc = 2;
+                    break;
+                }
+                if ( io_write(&p->out, buf, BUILTIN_BLOCK - z.avail_out) < 0 ) {
+                    rc = write_failed(p);
+                    break;
+                }
+                if ( zrc == Z_STREAM_END ) {
+                    in_stream = 0;
+                    inflateReset(&z); // another member may follow
+                }
+            }
+        }
+        // Whatever inflate still holds for this source
+        while ( rc >= 0 && rc < 2 && in_stream ) {
+            z.next_out = (Bytef*)buf;
+            z.avail_out = BUILTIN_BLOCK;
+            int zrc = inflate(&z, Z_FINISH);
+            if ( io_write(&p->out, buf, BUILTIN_BLOCK - z.avail_out) < 0 ) {
+                rc = write_failed(p);
+            } else if ( zrc == Z_STREAM_END ) {
+                in_stream = 0;
+            } else if ( zrc != Z_BUF_ERROR || z.avail_out != 0 ) {
+                builtin_error(p, "%s: unexpected end of file", source);
+                rc = 2;
+            }
+        }
+        source_close(fd);
+    }
+    inflateEnd(&z);
+    free(raw);
+    free(buf);
+    return rc;
+}
+
+// cmr:grep [-v] [-F] [-e] pattern [-e pattern ...], fixed strings only. Exits like grep: 1 when nothing matched.
+typedef struct GrepState_T {
+    char** patterns;
+    int* lens;
+    long long* next; // where each pattern next occurs in the block, from a previous search
+    int num_patterns;
+    OutBuffer out;
+    long long selected;
+} GrepState;
+
+long long
+first_match(GrepState* g, const char* buf, long long pos, long long end) {
+    long long first = end;
+    for ( int k=0; k<g->num_patterns; k++ ) {
+        if ( g->next[k] < pos ) {
+            const char* hit = (const char*)memmem(&buf[pos], end - pos, g->patterns[k], g->lens[k]);
+            g->next[k] = hit ? hit - buf : end;
+        }
+        if ( g->next[k] < first ) {
+            first = g->next[k];
+        }
+    }
+    return first;
+}
+
+// Whole lines in buf[0, end), the last one may lack its newline
+int
+grep_lines(ProcInfo* p, GrepState* g, const char* buf, long long end, int invert) {
+    for ( int k=0; k<g->num_patterns; k++ ) {
+        g->next[k] = -1;
+    }
+    long long pos = 0;
+    while ( pos < end ) {
+        long long hit = first_match(g, buf, pos, end);
+        if ( hit == end ) {
+            if ( invert && end > pos ) {
+                g->selected++;
+                if ( out_add(p, &g->out, &buf[pos], end - pos) < 0 ) { return -1; }
+            }
+            return 0;
+        }
+        const char* nl = (const char*)memrchr(&buf[pos], '\n', hit - pos);
+        long long line = nl ? nl + 1 - buf : pos;
+        nl = (const char*)memchr(&buf[hit], '\n', end - hit);
+        long long line_end = nl ? nl + 1 - buf : end;
+        if ( invert ) {
+            if ( line > pos ) {
+                g->selected++;
+                if ( out_add(p, &g->out, &buf[pos], line - pos) < 0 ) { return -1; }
+            }
+        } else {
+            g->selected++;
+            if ( out_add(p, &g->out, &buf[line], line_end - line) < 0 ) { return -1; }
+        }
+        pos = line_end;
+    }
+    return 0;
+}
+
+int
+grep_main(ProcInfo* p) {
+    GrepState g;
+    memset(&g, 0, sizeof(g));
+    g.patterns = (char**)calloc(p->num_args, sizeof(char*));
+    int invert = 0;
+    for ( int a=1; a<p->num_args; a++ ) {
+        if ( strcmp(p->spawn_args[a], "-v") == 0 ) {
+            invert = 1;
+        } else if ( strcmp(p->spawn_args[a], "-F") == 0 ) {
+            continue;
+        } else if ( strcmp(p->spawn_args[a], "-e") == 0 && a+1 < p->num_args ) {
+            g.patterns[g.num_patterns++] = p->spawn_args[++a];
+        } else if ( p->spawn_args[a][0] == '-' ) {
+            builtin_error(p, "unsupported option %s", p->spawn_args[a]);
+            return 2;
+        } else {
+            g.patterns[g.num_patterns++] = p->spawn_args[a];
+        }
+    }
+    if ( g.num_patterns == 0 ) {
+        builtin_error(p, "no pattern");
+        return 2;
+    }
+    g.lens = (int*)malloc(g.num_patterns * sizeof(int));
+    g.next = (long long*)malloc(g.num_patterns * sizeof(long long));
+    for ( int k=0; k<g.num_patterns; k++ ) {
+        g.lens[k] = strlen(g.patterns[k]);
+    }
+
+    // Lines are searched a block at a time, a partial line at the end is carried over to the next block
+    size_t size = BUILTIN_BLOCK;
+    char* buf = (char*)malloc(size);
+    size_t len = 0;
+    int rc = 0;
+    ssize_t rd;
+    while ( ( rd = io_read(&p->in, &buf[len], size - len) ) > 0 ) {
+        len += rd;
+        char* nl = (char*)memrchr(buf, '\n', len);
+        if ( !nl ) {
+            if ( len == size ) {
+                size *= 2;
+                buf = (char*)realloc(buf, size);
+            }
+            continue;
+        }
+        size_t lines = nl + 1 - buf;
+        if ( grep_lines(p, &g, buf, lines, invert) < 0 ) {
+            rc = write_failed(p);
+            break;
+        }
+        memmove(buf, &buf[lines], len - lines);
+        len -= lines;
+    }
+    if ( rc == 0 && rd < 0 && errno != EPIPE ) {
+        builtin_error(p, "read failed: %s", strerror(errno));
+        rc = 2;
+    }
+    if ( rc == 0 && len > 0 ) {
+        // A last line without its newline goes out with one
+        long long before = g.selected;
+        if ( grep_lines(p, &g, buf, len, invert) < 0 || ( g.selected > before && out_add(p, &g.out, "\n", 1) < 0 ) ) {
+            rc = write_failed(p);
+        }
+    }
+    if ( rc == 0 && out_flush(p, &g.out) < 0 ) {
+        rc = write_failed(p);
+    }
+    if ( rc == 0 && g.selected == 0 ) {
+        rc = 1;
+    }
+    free(buf);
+    free(g.out.data);
+    free(g.patterns);
+    free(g.lens);
+    free(g.next);
+    return rc;
+}
+
+// cmr:write [-s <MB>] [--dontneed], gathers its input into large writes like the output chunky
+int
+write_main(ProcInfo* p) {
+    size_t size = 16;
+    int dontneed = 0;
+    for ( int a=1; a<p->num_args; a++ ) {
+        if ( strcmp(p->spawn_args[a], "-s") == 0 && a+1 < p->num_args ) {
+            size = atoi(p->spawn_args[++a]);
+        } else if ( strcmp(p->spawn_args[a], "--dontneed") == 0 ) {
+            dontneed = 1;
+        } else {
+            builtin_error(p, "unsupported option %s", p->spawn_args[a]);
+            return 2;
+        }
+    }
+    size = ( size > 0 ? size : 1 ) * 1024 * 1024;
+
+    struct stat st;
+    if ( p->out.ring || fstat(p->out.fd, &st) != 0 || !S_ISREG(st.st_mode) ) {
+        dontneed = 0;
+    }
+
+    char* buf = (char*)malloc(size);
+    off_t written = 0;
+    int rc = 0;
+    ssize_t rd = 1;
+    while ( rd > 0 ) {
+        size_t len = 0;
+        while ( len < size && ( rd = io_read(&p->in, &buf[len], size - len) ) > 0 ) {
+            len += rd;
+        }
+        if ( len > 0 && io_write(&p->out, buf, len) < 0 ) {
+            rc = write_failed(p);
+            break;
+        }
+        if ( dontneed && len > 0 ) {
+            sync_file_range(p->out.fd, written, len, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(p->out.fd, written, len, POSIX_FADV_DONTNEED);
+        }
+        written += len;
+    }
+    if ( rc == 0 && rd < 0 && errno != EPIPE ) {
+        builtin_error(p, "read failed: %s", strerror(errno));
+        rc = 2;
+    }
+    free(buf);
+    return rc;
+}
+
+struct {
+    const char* name;
+    BuiltinMain run;
+} builtins[] = {
+    { "cmr:cat",   cat_main },
+    { "cmr:zcat",  zcat_main },
+    { "cmr:grep",  grep_main },
+    { "cmr:write", write_main },
+    { NULL, NULL },
+};
+
+BuiltinMain
+find_builtin(const char* name) {
+    for ( int b=0; builtins[b].name; b++ ) {
+        if ( strcmp(builtins[b].name, name) == 0 ) {
+            return builtins[b].run;
+        }
+    }
+    return NULL;
+}
+
+// Is the stage after the one at cur_arg run by a thread, a builtin or a --CMR_PARALLEL stage?
+int
+next_is_threaded(int argc, char* argv[], int cur_arg) {
+    while ( cur_arg < argc && argv[cur_arg][0] != ':' ) {
+        cur_arg++;
+    }
+    int command = 1;
+    for ( cur_arg++; cur_arg < argc && argv[cur_arg][0] != ':'; cur_arg++ ) {
+        if ( strcmp(argv[cur_arg], "--CMR_PARALLEL") == 0 && cur_arg + 1 < argc ) {
+            if ( atoi(argv[cur_arg+1]) > 1 ) {
+                return 1;
+            }
+        } else if ( strcmp(argv[cur_arg], "--CMR_ORDERED") == 0 ) {
+            continue;
+        } else if ( strncmp(argv[cur_arg], "--CMR_", 6) != 0 ) {
+            if ( command && find_builtin(argv[cur_arg]) ) {
+                return 1;
+            }
+            command = 0;
+            continue;
+        }
+        cur_arg++; // the option's value
+    }
+    return 0;
+}
+
+void
+add_usage(struct rusage* to, const struct rusage* from) {
+    timeradd(&to->ru_utime, &from->ru_utime, &to->ru_utime);
+    timeradd(&to->ru_stime, &from->ru_stime, &to->ru_stime);
+    to->ru_maxrss = from->ru_maxrss > to->ru_maxrss ? from->ru_maxrss : to->ru_maxrss;
+    to->ru_nvcsw += from->ru_nvcsw;
+    to->ru_nivcsw += from->ru_nivcsw;
+}
+
+// Returns how much was written, short of len if the write failed
+size_t
+write_all(int fd, const char* data, size_t len) {
+    size_t done = 0;
+    while ( done < len ) {
+        ssize_t wr = write(fd, &data[done], len - done);
+        if ( wr < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( wr < 0 ) {
+            break;
+        }
+        done += wr;
+    }
+    return done;
+}
+
+void
+wake(int fd) {
+    uint64_t one = 1;
+    write(fd, &one, sizeof(one));
+}
+
+// Parallel stages
+//
+// --CMR_PARALLEL n runs n copies of a single threaded process on blocks of whole lines, dealt out in turn. Their
+// output comes out a line at a time as it's written, in no particular order. With --CMR_ORDERED each block gets a
+// copy of its own instead and the output of each block comes out whole, in input order, the blocks after it held
+// back until then.
+
+// Returns -1 if the copy didn't start
+int
+start_copy(Fanout* f, Copy* c, long long block) {
+    ProcInfo* p = f->p;
+    int in[2];
+    int out[2];
+    pipe2(in, O_CLOEXEC);
+    pipe2(out, O_CLOEXEC);
+    fcntl(WRITE_END(in), F_SETPIPE_SZ, p->pipe_size);
+
+    posix_spawn_file_actions_t action;
+    posix_spawn_file_actions_init(&action);
+    posix_spawn_file_actions_adddup2(&action, READ_END(in), FD_STDIN);
+    posix_spawn_file_actions_adddup2(&action, WRITE_END(out), FD_STDOUT);
+    posix_spawn_file_actions_adddup2(&action, p->err_fd, FD_STDERR);
+    pid_t pid;
+    int rc = posix_spawnp(&pid, p->spawn_args[0], &action, &attr, p->spawn_args, NULL);
+    posix_spawn_file_actions_destroy(&action);
+    close(READ_END(in));
+    close(WRITE_END(out));
+    if ( rc != 0 ) {
+        close(WRITE_END(in));
+        close(READ_END(out));
+        builtin_error(p, "failed to start %s", p->spawn_args[0]);
+        return -1;
+    }
+    fcntl(READ_END(out), F_SETFL, fcntl(READ_END(out), F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_lock(&f->lock);
+    c->state = COPY_RUNNING;
+    c->pid = pid;
+    c->in_fd = WRITE_END(in);
+    c->out_fd = READ_END(out);
+    c->block = block;
+    pthread_mutex_unlock(&f->lock);
+    wake(f->wake_fd);
+    return 0;
+}
+
+void
+hold_output(Copy* c, const char* data, size_t len) {
+    if ( c->pending_len + len > c->pending_size ) {
+        c->pending_size = ( c->pending_len + len ) * 2;
+        c->pending = (char*)realloc(c->pending, c->pending_size);
+    }
+    memcpy(&c->pending[c->pending_len], data, len);
+    c->pending_len += len;
+}
+
+// Output once the copies' lines can no longer go anywhere is dropped
+void
+merge_write(Fanout* f, const char* data, size_t len) {
+    if ( f->rc == 0 && len > 0 && io_write(&f->p->out, data, len) < 0 ) {
+        f->rc = write_failed(f->p);
+        pthread_mutex_lock(&f->lock);
+        f->failed = 1;
+        for ( int k = 0; k < f->p->copies; k++ ) {
+            if ( f->copies[k].state == COPY_RUNNING ) {
+                kill(f->copies[k].pid, SIGKILL);
+            }
+        }
+        pthread_cond_broadcast(&f->changed);
+        pthread_mutex_unlock(&f->lock);
+    }
+}
+
+void
+merge_output(Fanout* f, Copy* c, const char* data, size_t len) {
+    if ( f->p->ordered ) {
+        if ( c->block == f->merged ) {
+            merge_write(f, data, len);
+        } else {
+            hold_output(c, data, len);
+        }
+        return;
+    }
+    // Lines from different copies mustn't interleave
+    const char* nl = (const char*)memrchr(data, '\n', len);
+    if ( !nl ) {
+        hold_output(c, data, len);
+        return;
+    }
+    size_t lines = nl + 1 - data;
+    merge_write(f, c->pending, c->pending_len);
+    merge_write(f, data, lines);
+    c->pending_len = 0;
+    hold_output(c, nl + 1, len - lines);
+}
+
+// A copy's output ended, it's reaped and its failure ends the dealing
+void
+end_copy(Fanout* f, Copy* c) {
+    close(c->out_fd);
+    c->out_fd = -1;
+
+    int status;
+    struct rusage usage;
+    while ( wait4(c->pid, &status, 0, &usage) < 0 && errno == EINTR );
+    add_usage(&f->usage, &usage);
+
+    if ( !f->p->ordered ) {
+        merge_write(f, c->pending, c->pending_len); // a last line without its newline
+        c->pending_len = 0;
+    }
+
+    pthread_mutex_lock(&f->lock);
+    int failed = stage_failed(f->p, status);
+    if ( ( status != 0 && f->status == 0 ) || ( failed && !f->failed ) ) {
+        f->status = status;
+    }
+    if ( failed ) {
+        f->failed = 1;
+    }
+    c->state = f->p->ordered ? COPY_WAITING : COPY_FREE;
+    pthread_cond_broadcast(&f->changed);
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Ordered, pass on whole blocks as their turn comes and hand over to the output of the next running one
+void
+merge_in_order(Fanout* f) {
+    for (;;) {
+        Copy* next = NULL;
+        pthread_mutex_lock(&f->lock);
+        for ( int k = 0; k < f->p->copies; k++ ) {
+            if ( f->copies[k].state != COPY_FREE && f->copies[k].block == f->merged ) {
+                next = &f->copies[k];
+            }
+        }
+        int running = next && next->state == COPY_RUNNING;
+        pthread_mutex_unlock(&f->lock);
+        if ( !next ) {
+            return;
+        }
+        merge_write(f, next->pending, next->pending_len);
+        next->pending_len = 0;
+        if ( running ) {
+            return;
+        }
+        pthread_mutex_lock(&f->lock);
+        next->state = COPY_FREE;
+        f->merged++;
+        pthread_cond_broadcast(&f->changed);
+        pthread_mutex_unlock(&f->lock);
+    }
+}
+
+void*
+merge_thread(void* arg) {
+    Fanout* f = (Fanout*)arg;
+    ProcInfo* p = f->p;
+    char* buf = (char*)malloc(BUILTIN_BLOCK);
+    struct pollfd fds[MAX_COPIES+1];
+    Copy* polled[MAX_COPIES+1];
+
+    for (;;) {
+        int n = 0;
+        int busy = 0;
+        fds[n].fd = f->wake_fd;
+        fds[n].events = POLLIN;
+        polled[n++] = NULL;
+        pthread_mutex_lock(&f->lock);
+        for ( int k = 0; k < p->copies; k++ ) {
+            busy |= f->copies[k].state != COPY_FREE;
+            if ( f->copies[k].state == COPY_RUNNING ) {
+                fds[n].fd = f->copies[k].out_fd;
+                fds[n].events = POLLIN;
+                polled[n++] = &f->copies[k];
+            }
+        }
+        int finished = f->dealing_done && !busy;
+        pthread_mutex_unlock(&f->lock);
+        if ( finished ) {
+            break;
+        }
+
+        if ( poll(fds, n, -1) < 0 ) {
+            continue;
+        }
+        if ( fds[0].revents ) {
+            uint64_t count;
+            read(f->wake_fd, &count, sizeof(count));
+        }
+        for ( int k = 1; k < n; k++ ) {
+            if ( !fds[k].revents ) {
+                continue;
+            }
+            ssize_t rd = read(fds[k].fd, buf, BUILTIN_BLOCK);
+            if ( rd > 0 ) {
+                merge_output(f, polled[k], buf, rd);
+            } else if ( rd == 0 || ( errno != EAGAIN && errno != EINTR ) ) {
+                end_copy(f, polled[k]);
+            }
+        }
+        if ( p->ordered ) {
+            merge_in_order(f);
+        }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    add_usage(&f->usage, &usage);
+    free(buf);
+    return NULL;
+}
+
+// Ordered, the copy to give the next block to once there is one free
+Copy*
+free_copy(Fanout* f) {
+    pthread_mutex_lock(&f->lock);
+    for (;;) {
+        for ( int k = 0; k < f->p->copies; k++ ) {
+            if ( f->copies[k].state == COPY_FREE && !f->failed ) {
+                pthread_mutex_unlock(&f->lock);
+                return &f->copies[k];
+            }
+        }
+        if ( f->failed ) {
+            pthread_mutex_unlock(&f->lock);
+            return NULL;
+        }
+        pthread_cond_wait(&f->changed, &f->lock);
+    }
+}
+
+// Returns -1 once nothing more can be dealt, -2 if a copy didn't start
+int
+deal(Fanout* f, const char* data, size_t len, long long block, int* next) {
+    ProcInfo* p = f->p;
+    pthread_mutex_lock(&f->lock);
+    int failed = f->failed;
+    pthread_mutex_unlock(&f->lock);
+    if ( failed ) {
+        return -1;
+    }
+    if ( p->ordered ) {
+        Copy* c = free_copy(f);
+        if ( !c ) {
+            return -1;
+        }
+        if ( start_copy(f, c, block) < 0 ) {
+            return -2;
+        }
+        write_all(c->in_fd, data, len); // a copy that stops reading early just misses the rest of its block
+        close(c->in_fd);
+        return 0;
+    }
+    // A copy that's gone (or closed its input) is passed over. Only a block it took none of moves on to the next
+    // copy, one it took part of was seen by it and, like an ordered copy's, the rest of it is missed.
+    for ( int tries = 0; tries < p->copies; tries++ ) {
+        Copy* c = &f->copies[(*next)++ % p->copies];
+        if ( c->in_fd < 0 ) {
+            continue;
+        }
+        size_t written = write_all(c->in_fd, data, len);
+        if ( written == len ) {
+            return 0;
+        }
+        close(c->in_fd);
+        c->in_fd = -1;
+        if ( written > 0 ) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int
+parallel_main(ProcInfo* p) {
+    Fanout* f = p->fanout;
+    int rc = 0;
+    for ( int k = 0; k < p->copies; k++ ) {
+        f->copies[k].in_fd = f->copies[k].out_fd = -1;
+    }
+    if ( !p->ordered ) {
+        for ( int k = 0; k < p->copies && rc == 0; k++ ) {
+            rc = start_copy(f, &f->copies[k], 0) < 0 ? 2 : 0;
+        }
+    }
+    pthread_t merger;
+    pthread_create(&merger, NULL, merge_thread, f);
+
+    // Whole lines a block at a time, a line longer than a block makes a bigger one
+    size_t block = p->ordered ? PARALLEL_ORDERED_BLOCK : PARALLEL_BLOCK;
+    size_t size = block;
+    char* buf = (char*)malloc(size);
+    size_t len = 0;
+    size_t want = block;
+    long long blocks = 0;
+    int next = 0;
+    int eof = rc != 0;
+    while ( !eof || len > 0 ) {
+        while ( !eof && len < want ) {
+            ssize_t rd = io_read(&p->in, &buf[len], size - len);
+            if ( rd < 0 && errno != EPIPE ) {
+                builtin_error(p, "read failed: %s", strerror(errno));
+                rc = 2;
+            }
+            eof = rd <= 0;
+            len += rd > 0 ? rd : 0;
+        }
+        if ( rc != 0 ) {
+            break;
+        }
+        size_t lines = len;
+        if ( !eof ) {
+            char* nl = (char*)memrchr(buf, '\n', len);
+            if ( !nl ) {
+                want = len + block;
+                if ( want > size ) {
+                    size = want;
+                    buf = (char*)realloc(buf, size);
+                }
+                continue;
+            }
+            lines = nl + 1 - buf;
+        }
+        int dealt = deal(f, buf, lines, blocks++, &next);
+        if ( dealt < 0 ) {
+            rc = dealt == -2 ? 2 : 0;
+            break;
+        }
+        memmove(buf, &buf[lines], len - lines);
+        len -= lines;
+        want = block;
+    }
+    free(buf);
+
+    pthread_mutex_lock(&f->lock);
+    f->dealing_done = 1;
+    pthread_mutex_unlock(&f->lock);
+    for ( int k = 0; k < p->copies; k++ ) {
+        if ( !p->ordered && f->copies[k].in_fd >= 0 ) {
+            close(f->copies[k].in_fd); // EOF for the copy
+        }
+    }
+    wake(f->wake_fd);
+    pthread_join(merger, NULL);
+
+    for ( int k = 0; k < p->copies; k++ ) {
+        free(f->copies[k].pending);
+    }
+    p->usage = f->usage;
+    if ( rc != 0 || f->rc != 0 ) {
+        return rc != 0 ? rc : f->rc;
+    }
+    if ( WIFSIGNALED(f->status) ) {
+        return -WTERMSIG(f->status);
+    }
+    return WEXITSTATUS(f->status);
+}
+
+void*
+builtin_thread(void* arg) {
+    ProcInfo* p = (ProcInfo*)arg;
+    int rc = p->builtin(p);
+    io_close(&p->in, 0);
+    io_close(&p->out, 1);
+    if ( p->no_stderr || p->copies ) {
+        close(p->err_fd);
+    }
+
+    p->bytes_in = p->in.bytes;
+    p->bytes_out = p->out.bytes;
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    add_usage(&p->usage, &usage);
+    p->wall = elapsed(&p->started);
+    p->status = rc < 0 ? -rc : rc << 8; // as a wait status
+    __atomic_store_n(&p->done, 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    write(builtins_fd, &one, sizeof(one));
+    return NULL;
+}
+
+// A list as the kernel writes CPU and node lists, "0-3,8,10-11"; returns -1 if it doesn't parse
+int
+parse_list(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    while ( *list ) {
+        char* end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if ( end == list ) {
+            return -1;
+        }
+        if ( *end == '-' ) {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if ( end == list ) {
+                return -1;
+            }
+        }
+        if ( first < 0 || last < first || last >= CPU_SETSIZE ) {
+            return -1;
+        }
+        for ( long n = first; n <= last; n++ ) {
+            CPU_SET(n, set);
+        }
+        if ( *end == ',' ) {
+            end++;
+        } else if ( *end ) {
+            return -1;
+        }
+        list = end;
+    }
+    return 0;
+}
+
+// Placement is advice, a pipeline that can't be placed still runs, so failures only go to stderr
+// (task_exec takes anything on stdout as an error)
+void
+set_cpus(const char* list) {
+    cpu_set_t cpus;
+    if ( parse_list(list, &cpus) != 0 || sched_setaffinity(0, sizeof(cpus), &cpus) != 0 ) {
+        fprintf(stderr, "cmr-pipe failed to set CPUs %s\n", list);
+    }
+}
+
+void
+set_membind(const char* list) {
+    cpu_set_t nodes;
+    unsigned long mask[CPU_SETSIZE / (8*sizeof(unsigned long))] = { 0 };
+    if ( parse_list(list, &nodes) == 0 ) {
+        for ( int n = 0; n < CPU_SETSIZE; n++ ) {
+            if ( CPU_ISSET(n, &nodes) ) {
+                mask[n / (8*sizeof(unsigned long))] |= 1UL << ( n % (8*sizeof(unsigned long)) );
+            }
+        }
+        if ( syscall(SYS_set_mempolicy, MPOL_BIND, mask, CPU_SETSIZE + 1) == 0 ) {
+            return;
+        }
+    }
+    fprintf(stderr, "cmr-pipe failed to bind memory to nodes %s\n", list);
+}
+
 int main(int argc, char* argv[]) {
 
     if (argc <= 1) {
         exit(1);
     }
 
-    pid_t pid;
-    struct sigaction act;
-
     int in = 0;
+    Ring* in_ring = NULL; // when a builtin feeds a builtin
 
     posix_spawn_file_actions_t action;
 
     char *path = (char*)malloc(1024);
     int cur_arg = 1;
     int i = 0;
-    int rd = 0;
 
-    act.sa_handler = &sigdeath;
-    sigemptyset (&act.sa_mask);
-    act.sa_flags = 0;
+    // Exits and termination requests come in through a signalfd, so the supervisor sleeps in
+    // epoll_wait until a process ends or writes to stderr. Blocked before anything is spawned so
+    // no exit is missed, the processes themselves get an empty mask.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sig_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+    builtins_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
 
-    sigaction (SIGTERM, &act, NULL);
-    sigaction (SIGKILL, &act, NULL);
-    sigaction (SIGINT,  &act, NULL);
-    sigaction (SIGQUIT, &act, NULL);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
 
-    if ( strcmp(argv[cur_arg], "--CMR_PIPE_UID" ) == 0 ) {
-        seteuid(atoi(argv[cur_arg+1]));
-        cur_arg+=2;
-    }
-    if ( strcmp(argv[cur_arg], "--CMR_PIPE_GID" ) == 0 ) {
-        setegid(atoi(argv[cur_arg+1]));
+    // The stats file is opened before giving up root, the worker owns it
+    FILE* stats = NULL;
+    int use_relay = 0;
+    int pipe_size = PIPE_SIZE; // --CMR_PIPE_SIZE before the first process sets it for all of them
+    while ( cur_arg + 1 < argc ) {
+        if ( strcmp(argv[cur_arg], "--CMR_PIPE_STATS" ) == 0 ) {
+            stats = fopen(argv[cur_arg+1], "w");
+        } else if ( strcmp(argv[cur_arg], "--CMR_PIPE_UID" ) == 0 ) {
+            seteuid(atoi(argv[cur_arg+1]));
+        } else if ( strcmp(argv[cur_arg], "--CMR_PIPE_GID" ) == 0 ) {
+            setegid(atoi(argv[cur_arg+1]));
+        } else if ( strcmp(argv[cur_arg], "--CMR_PIPE_SIZE" ) == 0 ) {
+            pipe_size = atoi(argv[cur_arg+1]);
+        } else if ( strcmp(argv[cur_arg], "--CMR_PIPE_CPUS" ) == 0 ) {
+            set_cpus(argv[cur_arg+1]); // processes and builtin threads inherit the mask
+        } else if ( strcmp(argv[cur_arg], "--CMR_PIPE_MEMBIND" ) == 0 ) {
+            set_membind(argv[cur_arg+1]); // and the memory policy
+        } else if ( strcmp(argv[cur_arg], "--CMR_PIPE_RELAY" ) == 0 ) {
+            use_relay = 1;
+            cur_arg++;
+            continue;
+        } else {
+            break;
+        }
         cur_arg+=2;
     }
 
-    while(cur_arg < argc) { 
+    // Writing to a pipe whose reader is gone is an error to hand back, not a reason to die. Processes get
+    // the default action back.
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF);
 
-        int start_arg = cur_arg;
+    while(cur_arg < argc) { 
 
         int out[2];
         int err[2];
 
-        pipe(out);
-        pipe(err);
+        // Close-on-exec, so a process only holds the ends dup'd onto its stdio and sees EOF when its peers go
+        pipe2(out, O_CLOEXEC);
+        pipe2(err, O_CLOEXEC);
 
         // Set read end of err to non-blocking
         fcntl(err[0], F_SETFL, fcntl(err[0], F_GETFL) | O_NONBLOCK);
@@ -114,6 +1515,9 @@ int main(int argc, char* argv[]) {
         processes[i].out_fd = WRITE_END(out);
         processes[i].no_stdout = 0;
         processes[i].no_stderr = 0;;
+        processes[i].pipe_size = pipe_size;
+        processes[i].relay_from = processes[i].relay_to = -1;
+        processes[i].relayed = -1;
 
         while( cur_arg < argc && ! ( argv[cur_arg][0] == ':' ) ) {
 
@@ -125,12 +1529,33 @@ int main(int argc, char* argv[]) {
                 continue;
             }
 
+            if ( strcmp(argv[cur_arg], "--CMR_PIPE_SIZE" ) == 0 ) {
+                cur_arg++;
+                processes[i].pipe_size = atoi(argv[cur_arg]);
+                cur_arg++;
+                continue;
+            }
+
+            if ( strcmp(argv[cur_arg], "--CMR_PARALLEL" ) == 0 ) {
+                cur_arg++;
+                processes[i].copies = atoi(argv[cur_arg]);
+                processes[i].copies = processes[i].copies < MAX_COPIES ? processes[i].copies : MAX_COPIES;
+                cur_arg++;
+                continue;
+            }
+
+            if ( strcmp(argv[cur_arg], "--CMR_ORDERED" ) == 0 ) {
+                processes[i].ordered = 1;
+                cur_arg++;
+                continue;
+            }
+
             if ( strcmp(argv[cur_arg], "--CMR_PIPE_OUT" ) == 0 ) {
 
                 cur_arg++;
 
                 sprintf(path, "%s", &argv[cur_arg][0]);
-                processes[i].out_fd = open( path, O_WRONLY|O_CREAT, S_IRUSR|S_IXUSR|S_IWUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH );
+                processes[i].out_fd = open( path, O_WRONLY|O_CREAT|O_CLOEXEC, S_IRUSR|S_IXUSR|S_IWUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH );
 
                 if (processes[i].out_fd < 0) {
                     fprintf(stdout, "cmr-pipe failed to open path %s\n", path);
@@ -147,7 +1572,7 @@ int main(int argc, char* argv[]) {
                 cur_arg++;
 
                 sprintf(path, "%s", &argv[cur_arg][0]);
-                processes[i].err_fd =  open( path, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH );
+                processes[i].err_fd =  open( path, O_WRONLY|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH );
 
                 if (processes[i].err_fd < 0) {
                     fprintf(stdout, "cmr-pipe failed to open path %s\n", path);
@@ -169,7 +1594,77 @@ int main(int argc, char* argv[]) {
             processes[i].name = processes[i].spawn_args[0];
         }
 
-        processes[i].spawn_args[cur_arg - start_arg] = '\0';
+        processes[i].spawn_args[processes[i].num_args] = NULL;
+
+        // Copies of a parallel stage are started by its thread, builtins can't be copied
+        processes[i].builtin = find_builtin(processes[i].spawn_args[0]);
+        if ( processes[i].builtin || processes[i].copies < 2 ) {
+            processes[i].copies = 0;
+        } else {
+            Fanout* f = (Fanout*)calloc(1, sizeof(Fanout));
+            f->p = &processes[i];
+            pthread_mutex_init(&f->lock, NULL);
+            pthread_cond_init(&f->changed, NULL);
+            f->wake_fd = eventfd(0, EFD_CLOEXEC);
+            processes[i].fanout = f;
+            processes[i].builtin = parallel_main;
+        }
+        if ( processes[i].builtin ) {
+            ProcInfo* p = &processes[i];
+            if ( !p->copies || p->no_stderr ) { // the copies' stderr is collected like a process's
+                close(READ_END(err));
+                close(WRITE_END(err));
+                p->err_read_fd = -1;
+            }
+
+            p->in.fd = in;
+            p->in.ring = in_ring;
+            in_ring = NULL;
+            p->out.fd = -1;
+            if ( p->no_stdout ) {
+                p->out.fd = p->out_fd;
+                close(WRITE_END(out));
+                in = READ_END(out);
+            } else if ( next_is_threaded(argc, argv, cur_arg) ) {
+                close(READ_END(out));
+                close(WRITE_END(out));
+                p->out.ring = in_ring = ring_new(4 * (size_t)p->pipe_size);
+                in = -1;
+            } else {
+                fcntl(WRITE_END(out), F_SETPIPE_SZ, p->pipe_size);
+                p->out.fd = WRITE_END(out);
+                in = READ_END(out);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &p->started);
+            pthread_t thread;
+            pthread_attr_t thread_attr;
+            pthread_attr_init(&thread_attr);
+            pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+            pthread_create(&thread, &thread_attr, builtin_thread, p);
+            pthread_attr_destroy(&thread_attr);
+
+            num_processes++;
+            i++;
+            cur_arg++;
+            continue;
+        }
+
+        // Bigger pipes mean fewer trips between processes per GB, the kernel caps what it'll give
+        fcntl(WRITE_END(out), F_SETPIPE_SZ, processes[i].pipe_size);
+
+        if ( use_relay && i > 0 && !processes[i-1].no_stdout && !processes[i-1].builtin ) {
+            // The previous process's output comes through us, this process reads the relay's pipe
+            int relayed[2];
+            pipe2(relayed, O_CLOEXEC|O_NONBLOCK);
+            fcntl(WRITE_END(relayed), F_SETPIPE_SZ, processes[i-1].pipe_size);
+            fcntl(in, F_SETFL, fcntl(in, F_GETFL) | O_NONBLOCK);
+            fcntl(READ_END(relayed), F_SETFL, fcntl(READ_END(relayed), F_GETFL) & ~O_NONBLOCK);
+            processes[i-1].relay_from = in;
+            processes[i-1].relay_to = WRITE_END(relayed);
+            processes[i-1].relayed = 0;
+            in = READ_END(relayed);
+        }
 
         posix_spawn_file_actions_init(&action);
         posix_spawn_file_actions_adddup2(&action, in, 0);
@@ -187,12 +1682,25 @@ int main(int argc, char* argv[]) {
         posix_spawn_file_actions_addclose(&action, READ_END(err));
 
 
-        posix_spawnp(&(processes[i].pid), processes[i].spawn_args[0], &action, NULL, processes[i].spawn_args, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &processes[i].started);
+        if ( posix_spawnp(&(processes[i].pid), processes[i].spawn_args[0], &action, &attr, processes[i].spawn_args, NULL) != 0 ) {
+            fprintf(stdout, "cmr-pipe failed to start %s\n", processes[i].spawn_args[0]);
+            sigdeath();
+        }
+        posix_spawn_file_actions_destroy(&action);
         if ( processes[i].err_fd != WRITE_END(err) ) { // If stderr is redirected, don't attempt to collect it
-            close(processes[i].err_fd);
+            close(WRITE_END(err));
             close(processes[i].err_read_fd);
+            processes[i].err_read_fd = -1;
         }
+        close(processes[i].err_fd);
         close(processes[i].out_fd);
+        if ( processes[i].out_fd != WRITE_END(out) ) {
+            close(WRITE_END(out));
+        }
+        if ( in != 0 ) {
+            close(in); // the process reading it has its own copy
+        }
         processes[i].finished = 0;
 
         in = READ_END(out);
@@ -202,64 +1710,126 @@ int main(int argc, char* argv[]) {
         cur_arg++;
     }
 
-    size_t buffer_size = 65535;
-    char* buf = (char*)malloc(buffer_size * sizeof(char));
-
-
-    int running_processes = num_processes;
-    int exit_status = 0;
-    int rc;
-    while ( running_processes > 0 ) {
+    buf = (char*)malloc(buffer_size * sizeof(char));
 
-      // Do some waitpids
-      for ( int j = 0; j < i; j++ ) {
-
-        // Grab whatever you can from stderr for this process
-        while ( ( rd = read(processes[j].err_read_fd, buf, buffer_size) ) > 0 ) {
-            fprintf(stdout, "%s: %s", processes[j].name, buf);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u32 = EV_SIGNALS;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sig_fd, &ev);
+    ev.data.u32 = EV_BUILTINS;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, builtins_fd, &ev);
+    for ( int j = 0; j < num_processes; j++ ) {
+        if ( processes[j].err_read_fd >= 0 ) {
+            ev.data.u32 = j;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, processes[j].err_read_fd, &ev);
         }
-        if (rd == 0) {
-            close(processes[j].err_read_fd);
+        if ( processes[j].relay_from >= 0 ) {
+            ev.data.u32 = EV_RELAY + j;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, processes[j].relay_from, &ev);
         }
+    }
 
-
-        if ( exit_status == 1 ) {
-          kill( processes[j].pid, SIGKILL);
+    int running_processes = 0;
+    int running_builtins = 0;
+    for ( int j = 0; j < num_processes; j++ ) {
+        if ( processes[j].builtin ) {
+            running_builtins++;
+        } else {
+            running_processes++;
         }
+    }
+    int exit_status = 0;
+    struct epoll_event events[2*MAX_PROCESSES+2];
 
-        if ( !processes[j].finished ) {
-        // Check to see if any of the processes have ended
-        rc = waitpid(processes[j].pid, &processes[j].status, WNOHANG);
-        if (rc != 0) {
-          running_processes--;
-          close(processes[j].err_fd);
-          processes[j].finished = 1;
+    // After a failure there's no waiting on builtins, one may be stuck on cmr-pipe's own stdin
+    while ( running_processes > 0 || ( running_builtins > 0 && !exit_status ) ) {
+        int n = epoll_wait(epfd, events, 2*MAX_PROCESSES+2, -1);
+        if ( n < 0 && errno == EINTR ) { continue; }
 
-          if ( WEXITSTATUS(processes[j].status) != 0 ) {
-            // A couple of strange exit codes that we'd rather not produce a failure on (we'll still get warnings in the logs)
-            if ( WEXITSTATUS(processes[j].status) == 1 ) {
-              if        ( strcmp(processes[j].spawn_args[0], "cat")  == 0 ) {
+        for ( int e = 0; e < n; e++ ) {
+            if ( events[e].data.u32 == EV_BUILTINS ) {
+                uint64_t count;
+                read(builtins_fd, &count, sizeof(count));
+                for ( int j = 0; j < num_processes; j++ ) {
+                    ProcInfo* p = &processes[j];
+                    if ( !p->builtin || p->finished || !__atomic_load_n(&p->done, __ATOMIC_ACQUIRE) ) {
+                        continue;
+                    }
+                    p->finished = 1;
+                    running_builtins--;
+                    if ( stage_failed(p, p->status) ) {
+                        exit_status = 1;
+                        kill_all();
+                    }
+                }
                 continue;
-              } else if ( strcmp(processes[j].spawn_args[0], "zcat") == 0 ) {
+            }
+            if ( events[e].data.u32 >= EV_RELAY ) {
+                relay(epfd, &processes[events[e].data.u32 - EV_RELAY], events[e].events & (EPOLLOUT|EPOLLERR));
                 continue;
-              } else if ( strcmp(processes[j].spawn_args[0], "grep") == 0) {
+            }
+            if ( events[e].data.u32 != EV_SIGNALS ) {
+                drain_stderr(epfd, &processes[events[e].data.u32]);
                 continue;
-              } else if ( (strcmp(processes[j].spawn_args[0], "sh") == 0) ) {
-                if        ( strncmp(processes[j].spawn_args[2], "cat",  sizeof("cat")-1)  == 0 ) {
-                  continue;
-                } else if ( strncmp(processes[j].spawn_args[2], "zcat", sizeof("zcat")-1) == 0 ) {
-                  continue;
-                } else if ( strncmp(processes[j].spawn_args[2], "grep", sizeof("grep")-1) == 0 ) {
-                  continue;
+            }
+
+            struct signalfd_siginfo si;
+            while ( read(sig_fd, &si, sizeof(si)) == sizeof(si) ) {
+                if ( si.ssi_signo != SIGCHLD ) {
+                    sigdeath();
+                }
+            }
+
+            // SIGCHLDs merge, so look for every process that's ready. Each is looked at before it's reaped,
+            // while its /proc entry still holds its I/O counts. Copies of parallel stages are left to their
+            // stage's thread.
+            for ( int j = 0; j < num_processes; j++ ) {
+                siginfo_t info;
+                if ( processes[j].builtin || processes[j].finished ) {
+                    continue;
+                }
+                info.si_pid = 0;
+                if ( waitid(P_PID, processes[j].pid, &info, WEXITED|WNOHANG|WNOWAIT) != 0 || info.si_pid == 0 ) {
+                    continue;
+                }
+                int status;
+                struct rusage usage;
+                if ( stats ) {
+                    read_io(&processes[j]);
+                }
+                wait4(info.si_pid, &status, 0, &usage);
+
+                processes[j].status = status;
+                processes[j].usage = usage;
+                processes[j].wall = elapsed(&processes[j].started);
+                processes[j].finished = 1;
+                running_processes--;
+
+                // A failed stage takes the rest of the pipeline down with it straight away
+                if ( stage_failed(&processes[j], status) ) {
+                    exit_status = 1;
+                    kill_all();
                 }
-              }
             }
-            exit_status = 1;
-          }
         }
+    }
+
+    // Anything written before the last exit is still in the pipes
+    for ( int j = 0; j < num_processes; j++ ) {
+        drain_stderr(epfd, &processes[j]);
+        if ( processes[j].relay_from >= 0 ) {
+            end_relay(epfd, &processes[j]);
+        }
+    }
+
+    if ( stats ) {
+        // Builtins still going after a failure have nothing to report
+        for ( int j = 0; j < num_processes; j++ ) {
+            if ( !processes[j].finished ) {
+                processes[j].status = SIGKILL;
+            }
         }
-      }
-      usleep(10000);
+        write_stats(stats);
     }
 
     exit(exit_status);
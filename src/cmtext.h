@@ -0,0 +1,124 @@
+/*  Copyright (C) 2014 Chitika Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Intermediate files back to text (chunky, cmr:cat)
+//
+// An intermediate file may be compressed (cmz.h) and may hold binary records (cmb.h). The decoder takes it in
+// whatever pieces it's read in and hands plain text lines to a sink, binary records each coming out as their
+// bytes and a newline. Include cmz.h and cmb.h first.
+
+typedef struct cmtext_decoder_t {
+    cmz_sink sink;
+    void* arg;
+    int compressed;
+    const char* error; // why decoding stopped, nothing more reaches the sink after it's set
+    cmz_decoder cmz;
+    int binary;        // -1 until the first bytes are seen
+    cmb_reader cmb;
+    char* carry;       // a record cut off at the end of a piece
+    size_t carry_len;
+    size_t carry_size;
+} cmtext_decoder;
+
+// Does a file starting with head need decoding?
+static inline int cmtext_is_encoded(const char* head, size_t len) {
+    return cmz_is_compressed(head, len) || cmb_is_binary(head, len);
+}
+
+// A decoder for a file, compressed if it starts with cmz.h's magic number
+static inline void cmtext_begin(cmtext_decoder* d, int compressed, cmz_sink sink, void* arg) {
+    memset(d, 0, sizeof(cmtext_decoder));
+    d->sink = sink;
+    d->arg = arg;
+    d->compressed = compressed;
+    d->binary = -1;
+}
+
+static inline void cmtext_carry(cmtext_decoder* d, const char* data, size_t len) {
+    if ( d->carry_len + len > d->carry_size ) {
+        d->carry_size = ( d->carry_len + len ) * 2;
+        d->carry = (char*)realloc(d->carry, d->carry_size);
+    }
+    memmove(&d->carry[d->carry_len], data, len);
+    d->carry_len += len;
+}
+
+// Plain (decompressed) data, binary records are turned back into lines
+static inline void cmtext_plain(void* arg, const char* data, size_t len) {
+    cmtext_decoder* d = (cmtext_decoder*)arg;
+    if ( d->error ) { return; }
+    if ( d->carry_len > 0 || ( d->binary < 0 && len < 4 ) ) {
+        cmtext_carry(d, data, len);
+        data = d->carry;
+        len = d->carry_len;
+        d->carry_len = 0;
+    }
+    if ( d->binary < 0 ) {
+        if ( len < 4 ) {
+            d->carry_len = len;
+            return;
+        }
+        d->binary = cmb_is_binary(data, len);
+    }
+    if ( !d->binary ) {
+        d->sink(d->arg, data, len);
+        return;
+    }
+
+    size_t pos = 0;
+    size_t used;
+    cmb_record rec;
+    int rc;
+    while ( ( rc = cmb_next(&d->cmb, &data[pos], len - pos, &used, &rec) ) == CMB_RECORD ) {
+        pos += used;
+        d->sink(d->arg, rec.key, rec.key_len + rec.rest_len);
+        d->sink(d->arg, "\n", 1);
+    }
+    if ( rc == CMB_ERROR ) {
+        d->error = "corrupt binary records";
+        return;
+    }
+    pos += used;
+    cmtext_carry(d, &data[pos], len - pos);
+}
+
+// The next piece of the file, returns -1 once decoding has failed (see d->error)
+static inline int cmtext_decode(cmtext_decoder* d, const char* data, size_t len) {
+    if ( !d->compressed ) {
+        cmtext_plain(d, data, len);
+    } else if ( !d->error && cmz_decode(&d->cmz, data, len, cmtext_plain, d) < 0 ) {
+        d->error = "corrupt compressed data";
+    }
+    return d->error ? -1 : 0;
+}
+
+// At the end of the file, returns -1 if it's corrupt or was cut short (see d->error)
+static inline int cmtext_end(cmtext_decoder* d) {
+    if ( cmz_decode_end(&d->cmz) < 0 && !d->error ) {
+        d->error = "truncated compressed data";
+    }
+    if ( !d->error ) {
+        if ( d->binary < 0 && d->carry_len > 0 ) {
+            d->sink(d->arg, d->carry, d->carry_len);
+        } else if ( d->binary > 0 && ( d->carry_len > 0 || !cmb_at_end(&d->cmb) ) ) {
+            d->error = "truncated binary records";
+        }
+    }
+    free(d->carry);
+    d->carry = NULL;
+    d->carry_len = d->carry_size = 0;
+    return d->error ? -1 : 0;
+}
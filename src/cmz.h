@@ -0,0 +1,143 @@
+/*  Copyright (C) 2014 Chitika Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Block compression of intermediate files (--compress)
+//
+// A compressed file is a run of independent frames, each holding at most CMZ_BLOCK bytes of data:
+//
+//     "\x89CMZ" | data length (le32) | stored length (le32) | stored bytes
+//
+// Stored bytes are a fast (level 1) zlib stream, or the data itself when that came out no smaller.
+// Frames don't refer to each other, so compressed files can be concatenated like plain ones.
+
+#include <stdint.h>
+#include <zlib.h>
+
+#define CMZ_MAGIC "\x89" "CMZ"
+#define CMZ_HEADER 12
+#define CMZ_BLOCK (1024*1024)
+#define CMZ_LEVEL 1
+
+static inline int cmz_is_compressed(const char* data, size_t len) {
+    return len >= 4 && memcmp(data, CMZ_MAGIC, 4) == 0;
+}
+
+static inline void cmz_put32(unsigned char* p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline uint32_t cmz_get32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Frame len bytes of data into *out (grown as needed), returns the framed length
+static inline size_t cmz_encode(const char* data, size_t len, char** out, size_t* out_size) {
+    size_t need = ( len / CMZ_BLOCK + 1 ) * ( CMZ_HEADER + compressBound(CMZ_BLOCK) );
+    if ( need > *out_size ) {
+        *out_size = need;
+        *out = (char*)realloc(*out, need);
+    }
+
+    size_t pos = 0;
+    while ( len > 0 ) {
+        size_t n = len < CMZ_BLOCK ? len : CMZ_BLOCK;
+        unsigned char* frame = (unsigned char*)&(*out)[pos];
+        uLongf stored = compressBound(n);
+        if ( compress2(&frame[CMZ_HEADER], &stored, (const Bytef*)data, n, CMZ_LEVEL) != Z_OK || stored >= n ) {
+            memcpy(&frame[CMZ_HEADER], data, n);
+            stored = n;
+        }
+        memcpy(frame, CMZ_MAGIC, 4);
+        cmz_put32(&frame[4], n);
+        cmz_put32(&frame[8], stored);
+        pos += CMZ_HEADER + stored;
+        data += n;
+        len -= n;
+    }
+    return pos;
+}
+
+// Decoding takes the file in whatever pieces it's read in, and hands each frame's data to a sink
+typedef void (*cmz_sink)(void* arg, const char* data, size_t len);
+
+typedef struct cmz_decoder_t {
+    char* pending; // a frame split across reads
+    size_t pending_len;
+    char* block;
+} cmz_decoder;
+
+static inline size_t cmz_frame_len(const unsigned char* frame) {
+    return CMZ_HEADER + cmz_get32(&frame[8]);
+}
+
+static inline int cmz_frame(cmz_decoder* d, const unsigned char* frame, cmz_sink sink, void* arg) {
+    uint32_t len = cmz_get32(&frame[4]);
+    uint32_t stored = cmz_get32(&frame[8]);
+    if ( stored == len ) {
+        sink(arg, (const char*)&frame[CMZ_HEADER], len);
+        return 0;
+    }
+    if ( !d->block ) { d->block = (char*)malloc(CMZ_BLOCK); }
+    uLongf out_len = CMZ_BLOCK;
+    if ( uncompress((Bytef*)d->block, &out_len, &frame[CMZ_HEADER], stored) != Z_OK || out_len != len ) { return -1; }
+    sink(arg, d->block, len);
+    return 0;
+}
+
+// Is this a believable frame header?
+static inline int cmz_header_ok(const unsigned char* frame) {
+    return memcmp(frame, CMZ_MAGIC, 4) == 0 && cmz_get32(&frame[4]) <= CMZ_BLOCK && cmz_get32(&frame[8]) <= compressBound(CMZ_BLOCK);
+}
+
+// Returns -1 on corrupt data
+static inline int cmz_decode(cmz_decoder* d, const char* data, size_t len, cmz_sink sink, void* arg) {
+    while ( len > 0 ) {
+        if ( d->pending_len > 0 || len < CMZ_HEADER || len < cmz_frame_len((const unsigned char*)data) ) {
+            // Gather a whole frame before decoding it
+            if ( !d->pending ) { d->pending = (char*)malloc(CMZ_HEADER + compressBound(CMZ_BLOCK)); }
+            size_t want = CMZ_HEADER;
+            if ( d->pending_len >= CMZ_HEADER ) { want = cmz_frame_len((const unsigned char*)d->pending); }
+            size_t n = want - d->pending_len < len ? want - d->pending_len : len;
+            memcpy(&d->pending[d->pending_len], data, n);
+            d->pending_len += n;
+            data += n;
+            len -= n;
+
+            if ( d->pending_len == CMZ_HEADER && !cmz_header_ok((const unsigned char*)d->pending) ) { return -1; }
+            if ( d->pending_len > CMZ_HEADER && d->pending_len == cmz_frame_len((const unsigned char*)d->pending) ) {
+                if ( cmz_frame(d, (const unsigned char*)d->pending, sink, arg) < 0 ) { return -1; }
+                d->pending_len = 0;
+            }
+            continue;
+        }
+
+        // Whole frames straight from the caller's buffer
+        const unsigned char* frame = (const unsigned char*)data;
+        if ( !cmz_header_ok(frame) || cmz_frame(d, frame, sink, arg) < 0 ) { return -1; }
+        data += cmz_frame_len(frame);
+        len -= cmz_frame_len(frame);
+    }
+    return 0;
+}
+
+// Returns -1 if the input ended inside a frame
+static inline int cmz_decode_end(cmz_decoder* d) {
+    int rc = d->pending_len > 0 ? -1 : 0;
+    free(d->pending);
+    free(d->block);
+    memset(d, 0, sizeof(cmz_decoder));
+    return rc;
+}
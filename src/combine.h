@@ -0,0 +1,122 @@
+/*  Copyright (C) 2014 Chitika Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Combining rows (--combine of cmr-bucket and cmr-merge)
+//
+// Rows fold per key the way cmr-reduce does them, the key is everything before the last <spec> fields and each
+// of those fields aggregates by its letter of the spec: c/s sum, m min, M max. Counts are summed, so partial
+// rows combine again later. Fields are split on cmr-reduce's ctrl-A whatever the bucket delimiter is.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define COMBINE_FIELD_DELIMITER '\001'
+#define COMBINE_MAX_AGGS 256
+
+typedef struct agg_state_t {
+    double value;
+    char* text; // m/M keep the winning field as written
+    int text_len;
+} agg_state;
+
+// Storage for a kept m/M field of len bytes, may reuse old (old_len bytes, NULL the first time)
+typedef char* (*combine_text_fn)(char* old, int old_len, int len);
+
+// The aggregation letters of a spec, returns how many
+static inline int combine_parse(const char* spec, char* types) {
+    int n = 0;
+    for ( ; *spec && n < COMBINE_MAX_AGGS; spec++ ) {
+        if ( strchr("csmM", *spec) ) { types[n++] = *spec; }
+    }
+    return n;
+}
+
+// Where the key of a row (without its newline) ends, NULL for a short line that doesn't combine
+static inline const char* combine_key_end(const char* data, const char* end, int num_aggs) {
+    const char* pos = end;
+    for ( int i=0; i<num_aggs && pos; i++ ) {
+        pos = (const char*)memrchr(data, COMBINE_FIELD_DELIMITER, pos - data);
+    }
+    return pos;
+}
+
+// Fold the aggregate fields starting at field (the delimiter before the first) into aggs, the first row of a
+// key takes them as they are. aggs start out zeroed.
+static inline void combine_fold(const char* types, int num_aggs, agg_state* aggs, const char* field, const char* end,
+                                int first, combine_text_fn keep) {
+    for ( int i=0; i<num_aggs; i++ ) {
+        field++; // past the delimiter
+        const char* field_end = (const char*)memchr(field, COMBINE_FIELD_DELIMITER, end - field);
+        if ( !field_end ) { field_end = end; }
+
+        // The row may be read only, parse a copy
+        char num[64];
+        int num_len = field_end - field < sizeof(num) ? field_end - field : sizeof(num) - 1;
+        memcpy(num, field, num_len);
+        num[num_len] = '\0';
+        double value = strtod(num, NULL);
+
+        agg_state* a = &aggs[i];
+        int take = first;
+        switch ( types[i] ) {
+            case 'c':
+            case 's':
+                a->value = first ? value : a->value + value;
+                break;
+            case 'm':
+                take = first || value < a->value;
+                break;
+            case 'M':
+                take = first || value > a->value;
+                break;
+        }
+        if ( take && ( types[i] == 'm' || types[i] == 'M' ) ) {
+            a->text = keep(a->text, a->text_len, field_end - field);
+            a->value = value;
+            a->text_len = field_end - field;
+            memcpy(a->text, field, a->text_len);
+        }
+        field = field_end;
+    }
+}
+
+// Most bytes the row of a key takes, newline included
+static inline size_t combine_row_size(const char* types, int num_aggs, const agg_state* aggs, int key_len) {
+    size_t len = key_len + 1;
+    for ( int i=0; i<num_aggs; i++ ) {
+        len += 1 + ( types[i] == 'm' || types[i] == 'M' ? aggs[i].text_len : 32 );
+    }
+    return len;
+}
+
+// Write the row of a key to line (combine_row_size bytes), returns its length
+static inline size_t combine_row(char* line, const char* key, int key_len, const char* types, int num_aggs,
+                                 const agg_state* aggs) {
+    memcpy(line, key, key_len);
+    size_t len = key_len;
+    for ( int i=0; i<num_aggs; i++ ) {
+        line[len++] = COMBINE_FIELD_DELIMITER;
+        if ( types[i] == 'm' || types[i] == 'M' ) {
+            memcpy(&line[len], aggs[i].text, aggs[i].text_len);
+            len += aggs[i].text_len;
+        } else {
+            len += snprintf(&line[len], 32, "%.15g", aggs[i].value);
+        }
+    }
+    line[len++] = '\n';
+    return len;
+}
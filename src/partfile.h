@@ -0,0 +1,84 @@
+/*  Copyright (C) 2014 Chitika Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Consolidated partition files (cmr-bucket --single-file)
+//
+// Every partition of a map goes in one file, one after another, followed by their offsets:
+//
+//     partition 0 | partition 1 | ... | le64 offset * (partitions+1) | le32 partitions | "CMRP"
+//
+// Readers name a partition as file#partition.
+
+#include <stdint.h>
+
+#define PARTFILE_MAGIC "CMRP"
+#define PARTFILE_TRAILER 8
+
+// Split a trailing #partition off path, returns the partition or -1
+static inline int partfile_split(char* path) {
+    char* hash = strrchr(path, '#');
+    if ( !hash || hash[1] == '\0' || strspn(hash+1, "0123456789") != strlen(hash+1) ) { return -1; }
+    *hash = '\0';
+    return atoi(hash+1);
+}
+
+static inline uint64_t partfile_get64(const unsigned char* p) {
+    uint64_t v = 0;
+    for ( int i=7; i>=0; i-- ) { v = v << 8 | p[i]; }
+    return v;
+}
+
+// Where partition part of the file is, returns -1 if the file has no such partition
+static inline int partfile_range(int fd, int part, off_t* offset, off_t* length) {
+    struct stat st;
+    unsigned char trailer[PARTFILE_TRAILER];
+    if ( fstat(fd, &st) != 0 || st.st_size < PARTFILE_TRAILER ) { return -1; }
+    if ( pread(fd, trailer, sizeof(trailer), st.st_size - PARTFILE_TRAILER) != sizeof(trailer) ) { return -1; }
+    if ( memcmp(&trailer[4], PARTFILE_MAGIC, 4) != 0 ) { return -1; }
+
+    uint32_t parts = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+    off_t index = st.st_size - PARTFILE_TRAILER - (off_t)(parts+1) * 8;
+    if ( part < 0 || part >= parts || index < 0 ) { return -1; }
+
+    unsigned char bounds[16];
+    if ( pread(fd, bounds, sizeof(bounds), index + (off_t)part * 8) != sizeof(bounds) ) { return -1; }
+    *offset = partfile_get64(bounds);
+    *length = partfile_get64(&bounds[8]) - *offset;
+    if ( *offset > index || *length < 0 || *offset + *length > index ) { return -1; }
+    return 0;
+}
+
+// Write the index that ends a file of parts partitions, offsets[parts] being where the last one ends.
+// Returns -1 if the write failed.
+static inline int partfile_write_index(int fd, const off_t* offsets, int parts) {
+    size_t len = (size_t)(parts+1) * 8 + PARTFILE_TRAILER;
+    unsigned char* index = (unsigned char*)malloc(len);
+    for ( int p=0; p<=parts; p++ ) {
+        for ( int i=0; i<8; i++ ) { index[p*8+i] = (uint64_t)offsets[p] >> (8*i); }
+    }
+    for ( int i=0; i<4; i++ ) { index[len - PARTFILE_TRAILER + i] = (uint32_t)parts >> (8*i); }
+    memcpy(&index[len - 4], PARTFILE_MAGIC, 4);
+
+    size_t pos = 0;
+    while ( pos < len ) {
+        ssize_t wr = write(fd, &index[pos], len - pos);
+        if ( wr < 0 && errno == EINTR ) { continue; }
+        if ( wr < 0 ) { break; }
+        pos += wr;
+    }
+    free(index);
+    return pos < len ? -1 : 0;
+}
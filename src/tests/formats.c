@@ -0,0 +1,243 @@
+/*  Copyright (C) 2014 Chitika Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Round trips through the intermediate formats: cmz.h frames, cmb.h records and cmtext.h back to lines.
+// Decoders are fed in pieces of awkward sizes, the way reads hand them data.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../cmz.h"
+#include "../cmb.h"
+#include "../cmtext.h"
+
+static int failures = 0;
+
+#define CHECK(cond, what) do { if ( !(cond) ) { fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, what); failures++; } } while (0)
+
+// A growing buffer, also the sink everything is written to
+typedef struct buf_t {
+    char* data;
+    size_t len;
+    size_t size;
+} buf;
+
+static void buf_sink(void* arg, const char* data, size_t len) {
+    buf* b = (buf*)arg;
+    if ( b->len + len > b->size ) {
+        b->size = ( b->len + len ) * 2;
+        b->data = (char*)realloc(b->data, b->size);
+    }
+    memcpy(&b->data[b->len], data, len);
+    b->len += len;
+}
+
+static const size_t pieces[] = { 1, 3, 7, 4096, 65537, (size_t)-1 };
+#define NUM_PIECES (sizeof(pieces) / sizeof(pieces[0]))
+
+// Lines of text, some of them repetitive enough to compress and some not
+static void make_lines(buf* text, int lines) {
+    unsigned int seed = 12345;
+    char line[256];
+    for ( int i=0; i<lines; i++ ) {
+        seed = seed * 1103515245 + 12345;
+        int len;
+        if ( i % 3 ) {
+            len = snprintf(line, sizeof(line), "key%06d\002value\001%d\001%u\n", i, i % 17, seed);
+        } else {
+            len = snprintf(line, sizeof(line), "key%06d\002", i);
+            int extra = seed % 120;
+            for ( int j=0; j<extra; j++ ) { line[len++] = 'a' + ( seed >> (j % 24) ) % 26; }
+            line[len++] = '\n';
+        }
+        buf_sink(text, line, len);
+    }
+}
+
+static void test_cmz(const buf* text) {
+    char* enc = NULL;
+    size_t enc_size = 0;
+    size_t enc_len = cmz_encode(text->data, text->len, &enc, &enc_size);
+    CHECK(enc_len > 0 && cmz_is_compressed(enc, enc_len), "cmz_encode frames its input");
+
+    for ( int p=0; p<NUM_PIECES; p++ ) {
+        buf out = {0};
+        cmz_decoder d = {0};
+        int rc = 0;
+        for ( size_t pos = 0; pos < enc_len && rc == 0; pos += pieces[p] ) {
+            size_t n = enc_len - pos < pieces[p] ? enc_len - pos : pieces[p];
+            rc = cmz_decode(&d, &enc[pos], n, buf_sink, &out);
+        }
+        CHECK(rc == 0 && cmz_decode_end(&d) == 0, "cmz_decode takes its own frames");
+        CHECK(out.len == text->len && memcmp(out.data, text->data, text->len) == 0, "cmz round trip");
+        free(out.data);
+    }
+
+    // Frames don't refer to each other, two encodings concatenate
+    buf both = {0};
+    buf_sink(&both, enc, enc_len);
+    buf_sink(&both, enc, enc_len);
+    buf out = {0};
+    cmz_decoder d = {0};
+    CHECK(cmz_decode(&d, both.data, both.len, buf_sink, &out) == 0 && cmz_decode_end(&d) == 0, "concatenated cmz decodes");
+    CHECK(out.len == 2 * text->len && memcmp(&out.data[text->len], text->data, text->len) == 0, "concatenated cmz round trip");
+    free(out.data);
+    free(both.data);
+
+    // Cut inside a frame, or corrupt
+    out.data = NULL;
+    out.len = out.size = 0;
+    memset(&d, 0, sizeof(d));
+    CHECK(cmz_decode(&d, enc, enc_len - 5, buf_sink, &out) == 0 && cmz_decode_end(&d) < 0, "truncated cmz is caught");
+    free(out.data);
+    out.data = NULL;
+    out.len = out.size = 0;
+    enc[1] ^= 0xff;
+    memset(&d, 0, sizeof(d));
+    CHECK(cmz_decode(&d, enc, enc_len, buf_sink, &out) < 0, "corrupt cmz is caught");
+    cmz_decode_end(&d);
+    free(out.data);
+    free(enc);
+}
+
+// Write the lines of text as records, key up to the \002, in two segments
+static void encode_cmb(const buf* text, buf* bin) {
+    cmb_writer w;
+    size_t half = text->len / 2;
+    const char* line = text->data;
+    const char* end = text->data + text->len;
+    for ( int segment = 0; segment < 2; segment++ ) {
+        cmb_begin(&w, buf_sink, bin);
+        const char* stop = segment == 0 ? text->data + half : end;
+        while ( line < stop ) {
+            const char* nl = (const char*)memchr(line, '\n', end - line);
+            const char* key_end = (const char*)memchr(line, '\002', nl - line);
+            if ( !key_end ) { key_end = nl; }
+            cmb_add(&w, line, key_end - line, key_end, nl - key_end);
+            line = nl + 1;
+        }
+        cmb_end(&w);
+    }
+}
+
+static void test_cmb(const buf* text) {
+    buf bin = {0};
+    encode_cmb(text, &bin);
+    CHECK(cmb_is_binary(bin.data, bin.len), "cmb starts with its magic number");
+
+    for ( int p=0; p<NUM_PIECES; p++ ) {
+        // Records are read out of whatever is at hand, leftovers carry over to the next piece
+        buf out = {0};
+        buf carry = {0};
+        cmb_reader r = {0};
+        int rc = CMB_MORE;
+        for ( size_t pos = 0; pos < bin.len && rc != CMB_ERROR; pos += pieces[p] ) {
+            size_t n = bin.len - pos < pieces[p] ? bin.len - pos : pieces[p];
+            buf_sink(&carry, &bin.data[pos], n);
+            size_t at = 0;
+            size_t used;
+            cmb_record rec;
+            while ( ( rc = cmb_next(&r, &carry.data[at], carry.len - at, &used, &rec) ) == CMB_RECORD ) {
+                at += used;
+                buf_sink(&out, rec.key, rec.key_len + rec.rest_len);
+                buf_sink(&out, "\n", 1);
+            }
+            at += used;
+            memmove(carry.data, &carry.data[at], carry.len - at);
+            carry.len -= at;
+        }
+        CHECK(rc != CMB_ERROR && carry.len == 0 && cmb_at_end(&r), "cmb_next reads its own segments");
+        CHECK(out.len == text->len && memcmp(out.data, text->data, text->len) == 0, "cmb round trip");
+        free(out.data);
+        free(carry.data);
+    }
+
+    // The index of a mapped file finds every block, in order
+    cmb_block* blocks = NULL;
+    int num_blocks = cmb_load_index(bin.data, bin.len, &blocks);
+    CHECK(num_blocks >= 2, "cmb_load_index finds the blocks of both segments");
+    for ( int i=1; i<num_blocks; i++ ) {
+        CHECK(blocks[i].offset >= blocks[i-1].end, "cmb blocks are in file order");
+    }
+    CHECK(num_blocks > 0 && blocks[0].key_len == 9 && memcmp(blocks[0].key, "key000000", 9) == 0, "cmb index holds the first key of a block");
+    free(blocks);
+    free(bin.data);
+}
+
+// Decode an intermediate file with cmtext.h, returns cmtext_end's result
+static int decode_text(const buf* file, size_t piece, buf* out) {
+    cmtext_decoder d;
+    cmtext_begin(&d, cmz_is_compressed(file->data, file->len), buf_sink, out);
+    for ( size_t pos = 0; pos < file->len; pos += piece ) {
+        size_t n = file->len - pos < piece ? file->len - pos : piece;
+        if ( cmtext_decode(&d, &file->data[pos], n) < 0 ) { break; }
+    }
+    return cmtext_end(&d);
+}
+
+static void test_cmtext(const buf* text) {
+    buf bin = {0};
+    encode_cmb(text, &bin);
+    buf zbin = {0};
+    zbin.len = cmz_encode(bin.data, bin.len, &zbin.data, &zbin.size);
+    buf ztext = {0};
+    ztext.len = cmz_encode(text->data, text->len, &ztext.data, &ztext.size);
+
+    const buf* files[] = { text, &bin, &zbin, &ztext };
+    const char* names[] = { "plain", "binary", "compressed binary", "compressed text" };
+    for ( int f=0; f<4; f++ ) {
+        CHECK(f == 0 || cmtext_is_encoded(files[f]->data, files[f]->len), names[f]);
+        for ( int p=0; p<NUM_PIECES; p++ ) {
+            buf out = {0};
+            int rc = decode_text(files[f], pieces[p], &out);
+            if ( rc != 0 || out.len != text->len || memcmp(out.data, text->data, text->len) != 0 ) {
+                fprintf(stderr, "FAIL cmtext round trip of %s in pieces of %zu\n", names[f], pieces[p]);
+                failures++;
+            }
+            free(out.data);
+        }
+    }
+
+    // Cut off mid record
+    buf cut = bin;
+    cut.len = bin.len / 3;
+    buf out = {0};
+    CHECK(decode_text(&cut, 4096, &out) < 0, "truncated cmb is caught");
+    free(out.data);
+
+    free(bin.data);
+    free(zbin.data);
+    free(ztext.data);
+}
+
+int main() {
+    buf text = {0};
+    make_lines(&text, 60000); // a few MB, more than one cmz frame and cmb block
+
+    test_cmz(&text);
+    test_cmb(&text);
+    test_cmtext(&text);
+
+    free(text.data);
+    if ( failures ) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("formats: ok\n");
+    return 0;
+}
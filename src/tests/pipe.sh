@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+#   Copyright (C) 2014 Chitika Inc.
+#
+#   This file is a part of Cmr
+#
+#   Cmr is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Exit status of cmr-pipe: any failed stage fails the pipeline, a stage killed by a signal included.
+# Only SIGPIPE before the last stage (a later one stopped reading) and cat/grep's exit 1 are let through.
+
+PIPE=${CMR_PIPE:-$(dirname "$0")/../cmr-pipe}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failures=0
+
+# expect <status> <cmr-pipe args ...>, the last stage writes to a scratch file
+expect() {
+    want=$1
+    shift
+    "$PIPE" "$@" --CMR_PIPE_OUT "$TMP/out" >"$TMP/err" 2>&1
+    got=$?
+    if [ "$got" -ne "$want" ]; then
+        echo "FAIL: cmr-pipe $* exited $got, expected $want" >&2
+        sed 's/^/    /' "$TMP/err" >&2
+        failures=$((failures+1))
+    fi
+}
+
+expect 0 echo a : cat
+expect 1 echo a : sh -c 'cat; exit 3' : cat
+expect 1 sh -c 'exit 3' : cat
+expect 1 echo a : cat : sh -c 'cat; exit 3'
+expect 0 echo a : grep nothing-matches
+
+# Killed by a signal
+expect 1 sh -c 'echo a; kill -9 $$' : cat
+expect 1 echo a : sh -c 'kill -TERM $$' : cat
+expect 1 echo a : sh -c 'kill -9 $$'
+
+# SIGPIPE only passes before the last stage
+expect 0 yes : head -n 1
+expect 0 yes : sh -c 'head -n 1' : cat
+expect 1 echo a : sh -c 'kill -PIPE $$'
+
+# Builtins
+expect 0 yes : cmr:cat : head -n 1
+expect 0 echo a : cmr:cat
+expect 0 cmr:cat "$TMP/no-such-file" : cat
+expect 1 echo a : cmr:cat : sh -c 'kill -9 $$'
+
+# Output arrives
+"$PIPE" printf 'b\na\n' : sort --CMR_PIPE_OUT "$TMP/out"
+if [ "$(cat "$TMP/out")" != "$(printf 'a\nb')" ]; then
+    echo "FAIL: cmr-pipe output" >&2
+    failures=$((failures+1))
+fi
+
+# A parallel copy that quits partway through its block doesn't have the block dealt again to another copy
+seq 1 10000 >"$TMP/in"
+rm -f "$TMP/out"
+expect 0 --CMR_PIPE_SIZE 4096 cat "$TMP/in" : awk '$1==5000{exit}{print}' --CMR_PARALLEL 2 : cat
+if [ "$(wc -l <"$TMP/out")" -ne 4999 ] || [ -n "$(sort "$TMP/out" | uniq -d)" ]; then
+    echo "FAIL: cmr-pipe parallel copy output, $(wc -l <"$TMP/out") lines" >&2
+    failures=$((failures+1))
+fi
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures failures" >&2
+    exit 1
+fi
+echo "pipe: ok"